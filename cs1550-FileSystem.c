@@ -10,6 +10,7 @@
 
 
 #define	FUSE_USE_VERSION 26
+#define	_GNU_SOURCE		//O_DIRECT
 #include <stdbool.h> 
 #include <fuse.h>
 #include <stdio.h>
@@ -17,8 +18,22 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/statvfs.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>	//BLKSSZGET, BLKGETSIZE64
+#include <stdint.h>
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define	FALLOC_FL_KEEP_SIZE 0x01
+#endif
 
 //size of a disk block
+#undef	BLOCK_SIZE	//sys/mount.h has its own
 #define	BLOCK_SIZE 512
 
 //we'll use 8.3 filenames
@@ -80,6 +95,28 @@ struct cs1550_index_block
 
 typedef struct cs1550_index_block cs1550_index_block;
 
+//Block numbers fit in the low 16 bits of an index entry, the bits above
+//carry per-cluster metadata (see the compression mode below)
+#define	ENTRY_BLOCK(e) ((e) & 0xffffL)
+#define	ENTRY_CLEN(e) (((e) >> 16) & 0xfffL)
+#define	MAKE_ENTRY(block, clen) ((long)(block) | ((long)(clen) << 16))
+
+//An index entry that doesn't point at a block (block 0 is always the root).
+//Such a hole in a file reads as zeros.
+#define	NO_BLOCK 0
+
+//Set on blocks reserved by fallocate that haven't been written yet, they
+//read as zeros too
+#define	ENTRY_UNWRITTEN 0x10000000L
+#define	ENTRY_HAS_DATA(e) (ENTRY_BLOCK(e) != NO_BLOCK && !((e) & ENTRY_UNWRITTEN))
+
+//File data is grouped into clusters of consecutive index entries. In
+//compression mode a cluster is compressed as a unit and stored in as few
+//blocks as it needs, the compressed length is kept in its first entry.
+#define	CLUSTER_BLOCKS 4
+#define	CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define	MAX_FILE_SIZE (MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE)
+
 //How much data can one block hold?
 #define	MAX_DATA_IN_BLOCK (BLOCK_SIZE)
 
@@ -92,277 +129,2370 @@ struct cs1550_disk_block
 
 typedef struct cs1550_disk_block cs1550_disk_block;
 
+//The bitmap lives in the last 3 blocks of the disk but only needs 1280 bytes
+//of them, the rest holds the superblock.
+#define	TOTAL_BLOCKS 10240
+#define	BITMAP_BYTES (TOTAL_BLOCKS / 8)
+#define	SUPERBLOCK_SIZE (3 * BLOCK_SIZE - BITMAP_BYTES)
+
+#define	CS1550_MAGIC 0x31353530
+#define	CS1550_VERSION 1
+
+struct cs1550_superblock
+{
+	int magic;		//CS1550_MAGIC once the disk has been formatted by this version
+	int version;	//on-disk format version
+	long nRefBlock;			//where the reference count table starts, NO_BLOCK if there is none
+	long nFingerprintBlock;	//where the dedup fingerprint index starts, NO_BLOCK if there is none
+
+	//Usage counters for statfs. Kept up to date in memory while mounted,
+	//written back at unmount and recounted at mount.
+	long nFreeBlocks;
+	long nDirectories;
+	long nFiles;
+
+	//How the volume is laid out over its backing files, 0 on disks from
+	//before striping (which are a single .disk)
+	int nDisks;
+	int nStripeBlocks;
+
+	long nSnapshotBlock;	//list of snapshots, laid out like the root, NO_BLOCK if none were taken
+
+	char padding[SUPERBLOCK_SIZE - 4 * sizeof(int) - 6 * sizeof(long)];
+};
+
+typedef struct cs1550_superblock cs1550_superblock;
+
+static cs1550_superblock superblock;	//read in at mount, counters are under alloc_lock
+
+//mount options, given with -o
+static struct cs1550_options
+{
+	int compress;	//store newly written file data compressed
+	int dedup;		//share identical data blocks between and within files
+	char* disks;	//backing files to stripe the volume over, separated by ':'
+	int stripe;		//stripe unit in blocks
+	char* trace;	//record every operation to this file
+	char* replay;	//run the operations in this trace instead of mounting
+	int replay_fast;	//don't wait for the recorded times
+	int replay_threads;
+	char* snapshot;	//mount this snapshot, read only
+	int direct;		//O_DIRECT, bypassing the host page cache
+} options;
+
+static struct fuse_opt cs1550_opts[] = {
+	{"compress", offsetof(struct cs1550_options, compress), 1},
+	{"dedup", offsetof(struct cs1550_options, dedup), 1},
+	{"disks=%s", offsetof(struct cs1550_options, disks), 0},
+	{"stripe=%d", offsetof(struct cs1550_options, stripe), 0},
+	{"trace=%s", offsetof(struct cs1550_options, trace), 0},
+	{"replay=%s", offsetof(struct cs1550_options, replay), 0},
+	{"replay_fast", offsetof(struct cs1550_options, replay_fast), 1},
+	{"replay_threads=%d", offsetof(struct cs1550_options, replay_threads), 0},
+	{"snapshot=%s", offsetof(struct cs1550_options, snapshot), 0},
+	{"direct", offsetof(struct cs1550_options, direct), 1},
+	FUSE_OPT_END
+};
+
 /*
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not.
- *
- * man -s 2 stat will show the fields of a stat structure
+ * The volume is TOTAL_BLOCKS blocks striped over one or more backing files
+ * in units of nStripeBlocks blocks: unit u of the volume is unit u/n of
+ * backing file u%n. With a single backing file (.disk unless the disks
+ * option names others) that is just the file itself. Everything else
+ * addresses the volume by byte offset and never sees the backing files.
  */
+#define	MAX_DISKS 8
+#define	DEFAULT_STRIPE_BLOCKS 16
+#define	LABEL_AREA 4096		//the label gets a whole page so the data after it stays aligned
+#define	VOLUME_SIZE ((long)TOTAL_BLOCKS * BLOCK_SIZE)
+#define	BITMAP_OFFSET (VOLUME_SIZE - 3 * BLOCK_SIZE)
+#define	SUPERBLOCK_OFFSET (VOLUME_SIZE - SUPERBLOCK_SIZE)
+//the bitmap and the superblock together, in whole blocks
+#define	BITMAP_AREA (3 * BLOCK_SIZE)
 
-//helper functions for bitmap operations
-//check if the given bit in the bitNum is 0
-static bool checkBit(int bitNum,int bitIndex){
-	return (bitNum >> bitIndex | 0) == 0;	//true if this bit is 'free'
+//The first block of each file in a striped set labels it, so that a set
+//given in the wrong order or mixed up with other files is caught at mount
+//instead of being read as garbage. A lone backing file has no label.
+struct cs1550_disk_label
+{
+	int magic;			//CS1550_MAGIC
+	int nDisk;			//position of this file in the set
+	int nDisks;
+	int nStripeBlocks;
+	int nDataStart;		//where the volume starts in the file, 0 for sets labelled before this was kept (BLOCK_SIZE)
+	char padding[BLOCK_SIZE - 5 * sizeof(int)];
+};
+
+static int disk_fds[MAX_DISKS];
+static int nDisks;
+static int nStripeBlocks = TOTAL_BLOCKS;
+static long data_start;		//where the volume starts in each backing file
+
+//a range of the volume to read or write
+struct disk_extent
+{
+	long offset;
+	char* buf;
+	size_t len;
+};
+
+//part of a range that lies in one stripe unit
+struct disk_segment
+{
+	int disk;
+	off_t offset;	//in the backing file
+	char* buf;
+	size_t len;
+};
+
+//the segments one backing file has to do for a request
+struct disk_job
+{
+	bool write;
+	int disk;
+	const struct disk_segment* segs;
+	int nSegs;
+	int res;
+	bool done;
+	struct disk_job* next;	//in the worker's queue
+};
+
+static int disk_io(bool write,int disk,off_t offset,char* buf,size_t len){
+	while(len>0){
+		ssize_t n = write ? pwrite(disk_fds[disk],buf,len,offset) : pread(disk_fds[disk],buf,len,offset);
+		if(n<0 && errno==EINTR){
+			continue;
+		}
+		if(n<0 || (n==0 && write)){
+			return -EIO;
+		}
+		if(n==0){	//past the end of a file that was never written that far
+			memset(buf,0,len);
+			return 0;
+		}
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
 }
-//sets the given index bit to 1
-static char setBit(int bitNum,int bitIndex){
-	return bitNum | (1<<bitIndex);
+
+/*
+ * With -o direct the backing files are opened O_DIRECT, bypassing the page
+ * cache. The cluster cache is then the only one, everything else goes to the
+ * device every time. Transfers have to be aligned to
+ * direct_align in the file and in memory. Callers use block_alloc buffers
+ * and whole blocks where they can, anything else goes through a bounce
+ * buffer from a fixed pool, read-modify-write for partial writes.
+ */
+#define	BUFFER_ALIGN 4096
+#define	DIRECT_POOL_BUFFERS 16
+#define	DIRECT_POOL_SIZE (64 * 1024)
+#define	DIRECT_LOCKS 64
+
+static size_t direct_align;		//0 unless the files are open O_DIRECT
+static char* direct_pool[DIRECT_POOL_BUFFERS];
+static int direct_pool_free;
+static pthread_mutex_t direct_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t direct_pool_cond = PTHREAD_COND_INITIALIZER;
+//Writes hold the locks of the aligned units they touch, so two partial
+//writes into the same unit can't undo each other
+static pthread_mutex_t direct_locks[DIRECT_LOCKS];
+
+//memory for a transfer, aligned so that O_DIRECT can use it as is
+static void* block_alloc(size_t size){
+	void* buf = NULL;
+	if(posix_memalign(&buf,BUFFER_ALIGN,size)!=0){
+		return NULL;
+	}
+	return buf;
 }
 
-static int bitmap_find(FILE* file){
-	char bitmap[1280];
-	fseek(file,-3*512,SEEK_END);
-	fread(bitmap,1280,1,file);
+static char* direct_pool_get(void){
+	pthread_mutex_lock(&direct_pool_lock);
+	while(direct_pool_free==0){
+		pthread_cond_wait(&direct_pool_cond,&direct_pool_lock);
+	}
+	char* buf = direct_pool[--direct_pool_free];
+	pthread_mutex_unlock(&direct_pool_lock);
+	return buf;
+}
+
+static void direct_pool_put(char* buf){
+	pthread_mutex_lock(&direct_pool_lock);
+	direct_pool[direct_pool_free++] = buf;
+	pthread_cond_signal(&direct_pool_cond);
+	pthread_mutex_unlock(&direct_pool_lock);
+}
+
+//takes the locks for the units of [offset, offset+len), always in the same order
+static uint64_t direct_lock(int disk,off_t offset,size_t len){
+	off_t first = offset/direct_align;
+	off_t last = (offset+len-1)/direct_align;
+	uint64_t held = 0;
+	off_t unit;
 	int k;
-	for(k=0;k<10240;k++){
-		if(checkBit(bitmap[k/8],k%8)){
-			bitmap[k/8]=setBit(bitmap[k/8],k%8);		//used	
-			//update the bitmap
-			fseek(file,-3*512,SEEK_END);
-			fwrite(bitmap,1280,1,file);
-			return k;
+	if(last-first>=DIRECT_LOCKS){
+		held = ~(uint64_t)0;
+	}
+	for(unit=first;unit<=last && held!=~(uint64_t)0;unit++){
+		held |= (uint64_t)1<<((unit*MAX_DISKS+disk)%DIRECT_LOCKS);
+	}
+	for(k=0;k<DIRECT_LOCKS;k++){
+		if(held & ((uint64_t)1<<k)){
+			pthread_mutex_lock(&direct_locks[k]);
 		}
 	}
-	return -1;	//not found
+	return held;
 }
-static int cs1550_getattr(const char *path, struct stat *stbuf)
-{
-	char dir_name[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
-	char ext[MAX_EXTENSION + 1]; 
-	int valid_name = sscanf(path, "/%[^/]/%[^.].%s", dir_name, filename, ext); 
-	//check the filename length
-	int res = 0;
-	FILE *fp = fopen(".disk","rb+");
-	memset(stbuf, 0, sizeof(struct stat));
-	//is path the root dir?
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-	}else if(valid_name==1){  //Check if name is subdirectory
-		//start from the root check the subdirectories
-		bool directory_found =false;
-		cs1550_root_directory* root_dir = malloc(sizeof(cs1550_root_directory));
-		fread(root_dir,sizeof(cs1550_root_directory),1,fp);
-		int i;
-		//printf("debugging 1:!\n");
-		for(i =0;i<root_dir->nDirectories;i++){
-			if(strcmp(dir_name,root_dir->directories[i].dname) == 0){
-				directory_found=true;
-				break;
-			}
-		}
-		if(directory_found){
-			//Might want to return a structure with these fields
-			stbuf->st_mode = S_IFDIR | 0755;
-			stbuf->st_nlink = 2;
-			res = 0; //no error
-		}
-		else{//use your god damn brakets okay?
-			res=-ENOENT;
+
+static void direct_unlock(uint64_t held){
+	int k;
+	for(k=DIRECT_LOCKS-1;k>=0;k--){
+		if(held & ((uint64_t)1<<k)){
+			pthread_mutex_unlock(&direct_locks[k]);
 		}
-		free(root_dir);
 	}
-	//Check if name is a regular file
-	else if(valid_name==3){
-		bool file_found =false;
-		fseek(fp,0,SEEK_SET);
-		cs1550_root_directory* root_dir1 = malloc(sizeof(cs1550_root_directory));
-		fread(root_dir1,sizeof(cs1550_root_directory),1,fp);
-		cs1550_directory_entry* sub_directory = malloc(sizeof(cs1550_directory_entry));
-		int i,j;
-		for(i =0;i<root_dir1->nDirectories;i++){
-			fseek(fp,512*root_dir1->directories[i].nStartBlock,SEEK_SET);
-			fread(sub_directory,sizeof(cs1550_directory_entry),1,fp);
-			for(j =0;j<sub_directory->nFiles;j++){
-				if(strcmp(filename,sub_directory->files[j].fname)==0 && strcmp(ext,sub_directory->files[j].fext)==0){
-					file_found = true;
-					break;
-				}
+}
+
+static int disk_transfer(bool write,int disk,off_t offset,char* buf,size_t len){
+	if(direct_align==0){
+		return disk_io(write,disk,offset,buf,len);
+	}
+	uint64_t held = write ? direct_lock(disk,offset,len) : 0;
+	int res = 0;
+	if(offset%direct_align==0 && len%direct_align==0 && (uintptr_t)buf%direct_align==0){
+		res = disk_io(write,disk,offset,buf,len);
+	}else{
+		char* bounce = direct_pool_get();
+		while(len>0 && res==0){
+			size_t head = offset%direct_align;
+			off_t start = offset-head;
+			size_t span = (head+len+direct_align-1)/direct_align*direct_align;
+			if(span>DIRECT_POOL_SIZE){
+				span = DIRECT_POOL_SIZE;
 			}
-			if(file_found)
-				break;
-		}
-		if(file_found){
-			//regular file, probably want to be read and write
-			stbuf->st_mode = S_IFREG | 0666;
-			stbuf->st_nlink = 1; //file links
-			stbuf->st_size = sub_directory->files[j].fsize; //file size - make sure you replace with real size!
-			res = 0; // no error
-		}
-		else{
-			//Else return that file doesn't exist
-			res = -ENOENT;
+			size_t part = span-head<len ? span-head : len;
+			if(!write || head!=0 || part%direct_align!=0){	//whatever we don't overwrite has to be kept
+				res = disk_io(false,disk,start,bounce,span);
+			}
+			if(res==0 && write){
+				memcpy(bounce+head,buf,part);
+				res = disk_io(true,disk,start,bounce,span);
+			}else if(res==0){
+				memcpy(buf,bounce+head,part);
+			}
+			offset += part;
+			buf += part;
+			len -= part;
 		}
-	free(root_dir1);
-	free(sub_directory);
+		direct_pool_put(bounce);
 	}
-	else{
-		res = -ENOENT;
+	if(write){
+		direct_unlock(held);
 	}
-	fclose(fp);
 	return res;
-	
 }
 
-/*
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
- */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
-{
-	char dir_name[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
-	char ext[MAX_EXTENSION + 1]; 
-	int valid_name = sscanf(path, "/%[^/]/%[^.].%s", dir_name, filename, ext); 
-	//check the filename length
-	if(valid_name>1){
-		return -ENOENT; 
+//the alignment O_DIRECT needs on this file, in the file and in memory
+static size_t direct_alignment(int fd){
+	struct stat st;
+	int sector;
+	if(fstat(fd,&st)==0 && S_ISBLK(st.st_mode) && ioctl(fd,BLKSSZGET,&sector)==0 && sector>0){
+		return sector;
 	}
-	//but if it's the root...
-	bool is_root = (strcmp(path,"/") == 0);
-	FILE *fp = fopen(".disk","rb+");
-	bool directory_found =false;
-	int dir_index = -1;
-	cs1550_root_directory* root_dir = malloc(sizeof(cs1550_root_directory)); //root
-	fread(root_dir,sizeof(cs1550_root_directory),1,fp);
-	if(is_root && root_dir->nDirectories==0 ){//if the root is empty
-		filler(buf, ".", NULL, 0);
-		filler(buf, "..", NULL, 0);
-		fclose(fp);
-		free(root_dir);
-		return 0;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+	if(statx(fd,"",AT_EMPTY_PATH,STATX_DIOALIGN,&stx)==0 && (stx.stx_mask & STATX_DIOALIGN)
+			&& stx.stx_dio_offset_align>0){
+		return stx.stx_dio_offset_align>stx.stx_dio_mem_align ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
 	}
-	int i,k;
-	
-	for(i =0;i<root_dir->nDirectories;i++){
-		if(is_root){
-			filler(buf,root_dir->directories[i].dname, NULL, 0);
-			continue;
+#endif
+	return BUFFER_ALIGN;	//right for nearly everything
+}
+
+//switches the open backing files over to O_DIRECT
+static int direct_start(char** paths)
+{
+	int k;
+	for(k=0;k<nDisks;k++){
+		size_t align = direct_alignment(disk_fds[k]);
+		if(align>direct_align){
+			direct_align = align;
 		}
-		
-		if(strcmp(dir_name,root_dir->directories[i].dname)==0){	//try to find where the directory is located in disk
-			directory_found=true;
-			dir_index = root_dir->directories[i].nStartBlock;
-			break;
+		fdatasync(disk_fds[k]);	//whatever the labelling left in the page cache
+		int flags = fcntl(disk_fds[k],F_GETFL);
+		if(flags<0 || fcntl(disk_fds[k],F_SETFL,flags | O_DIRECT)<0){
+			fprintf(stderr,"%s: no O_DIRECT here: %s\n",paths[k],strerror(errno));
+			direct_align = 0;
+			return -1;
 		}
 	}
-	if(is_root){
-		filler(buf, ".", NULL, 0);
-		filler(buf, "..", NULL, 0);
-		fclose(fp);
-		free(root_dir);
-		return 0;
+	if(direct_align>DIRECT_POOL_SIZE || DIRECT_POOL_SIZE%direct_align!=0){
+		fprintf(stderr,"can't do O_DIRECT with an alignment of %zu\n",direct_align);
+		direct_align = 0;
+		return -1;
 	}
-	if(!directory_found){
-		fclose(fp);
-		free(root_dir);
-		return -ENOENT;
+	for(k=0;k<DIRECT_LOCKS;k++){
+		pthread_mutex_init(&direct_locks[k],NULL);
 	}
-	//if we found the directory on disk, loop through it
-	cs1550_directory_entry* sub_directory = malloc(sizeof(cs1550_directory_entry));
-	fseek(fp,dir_index*512,SEEK_SET);
-	fread(sub_directory,sizeof(cs1550_directory_entry),1,fp);
-
-	char f_names[9];
-	char f_ext[4];
-	memset(f_names,'\0',sizeof(f_names));
-	memset(f_ext,'\0',sizeof(f_ext));
-	for(k=0;k<sub_directory->nFiles;k++){	//add all to the listing
-		strncpy(f_names,sub_directory->files[k].fname,sizeof(f_names)-1);
-		strncpy(f_ext,sub_directory->files[k].fext,sizeof(f_ext)-1);
-		char* fn1 = strcat(f_names,".");
-		char* fn2 = strcat(fn1,f_ext); 
-		filler(buf,fn2,NULL, 0);
+	for(k=0;k<DIRECT_POOL_BUFFERS;k++){
+		if(posix_memalign((void**)&direct_pool[k],direct_align>BUFFER_ALIGN ? direct_align : BUFFER_ALIGN,DIRECT_POOL_SIZE)!=0){
+			direct_pool_free = k;
+			return -1;
+		}
 	}
-
-	//Since we're building with -Wall (all warnings reported) we need
-	//to "use" every parameter, so let's just cast them to void to
-	//satisfy the compiler
-	(void) offset;
-	(void) fi;
-	//This line assumes we have no subdirectories, need to change
-	//if (strcmp(path, "/") != 0)
-	//return -ENOENT;
-	//the filler function allows us to add entries to the listing
-	//read the fuse.h file for a description (in the ../include dir)
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	/*
-	//add the user stuff (subdirs or files)
-	//the +1 skips the leading '/' on the filenames
-	filler(buf, newpath + 1, NULL, 0);
-	*/
-	fclose(fp);
-	free(root_dir);
-	free(sub_directory);
+	direct_pool_free = DIRECT_POOL_BUFFERS;
 	return 0;
 }
 
+static void* disk_job_run(void* arg){
+	struct disk_job* job = arg;
+	int k;
+	for(k=0;k<job->nSegs;k++){
+		const struct disk_segment* seg = &job->segs[k];
+		if(seg->disk==job->disk && disk_transfer(job->write,seg->disk,seg->offset,seg->buf,seg->len)<0){
+			job->res = -EIO;
+		}
+	}
+	return NULL;
+}
+
 /*
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
+ * Every backing file has a worker thread of its own. They are started once
+ * fuse has forked and are there until the files are closed. Until then
+ * disk_rw does all the work itself.
  */
-static int cs1550_mkdir(const char *path, mode_t mode)
-{
-	char dir_name[MAX_FILENAME +1];
-	char filename[MAX_FILENAME +1];
-	char ext[MAX_EXTENSION +1]; 
-	int valid_name = sscanf(path, "/%[^/]/%[^.].%s", dir_name, filename, ext); 
-	//check the filename length
-	//check if it's only under the root 
-	if(valid_name >1)
-	return -EPERM;
-	//check length
-	if(strlen(dir_name)>8){
-		return -ENAMETOOLONG;
-	}
-	FILE *fp = fopen(".disk","rb+");
-	cs1550_root_directory* root = malloc(sizeof(cs1550_root_directory));
-	//start from the root check the subdirectories
-	fread(root,sizeof(cs1550_root_directory),1,fp);
-	if(root->nDirectories == 29){
-		return -ENOSPC;
-	}
-	int i;
-	for(i =0;i<root->nDirectories;i++){
-		if(strcmp(dir_name,root->directories[i].dname) == 0){
-			return -EEXIST;
+static pthread_t disk_workers[MAX_DISKS];
+static int nWorkers;	//how many are running
+static bool disk_workers_stop;
+static struct disk_job* disk_queue[MAX_DISKS];	//waiting jobs, oldest first
+static struct disk_job* disk_queue_tail[MAX_DISKS];
+static pthread_mutex_t disk_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_work_cond[MAX_DISKS];
+static pthread_cond_t disk_done_cond = PTHREAD_COND_INITIALIZER;
+
+static void* disk_worker(void* arg){
+	int disk = (int)(long)arg;
+	pthread_mutex_lock(&disk_queue_lock);
+	while(true){
+		while(disk_queue[disk]==NULL && !disk_workers_stop){
+			pthread_cond_wait(&disk_work_cond[disk],&disk_queue_lock);
 		}
-	}
-	//
-	char bitmap[1280];
-	//search the bitmap to find the block
-	fseek(fp,-3*512,SEEK_END);
-	fread(bitmap,1280,1,fp);
-	int h;
-	for(h=0;h<10240;h++){
-		if(checkBit(bitmap[h/8],h%8)){
-			bitmap[h/8]=setBit(bitmap[h/8],h%8);
+		struct disk_job* job = disk_queue[disk];
+		if(job==NULL){
 			break;
 		}
+		disk_queue[disk] = job->next;
+		pthread_mutex_unlock(&disk_queue_lock);
+		disk_job_run(job);
+		pthread_mutex_lock(&disk_queue_lock);
+		job->done = true;
+		pthread_cond_broadcast(&disk_done_cond);
 	}
-	//add the new dir to root
-	root->nDirectories++;
-	int sizeof_name = sizeof(root->directories[root->nDirectories-1].dname);
-	strncpy(root->directories[root->nDirectories-1].dname,dir_name,sizeof_name);
-	root->directories[root->nDirectories-1].nStartBlock=h;
-	fseek(fp,0,SEEK_SET);
-	fwrite(root,sizeof(cs1550_root_directory),1,fp); //update the disk root
-	fseek(fp,-3*512,SEEK_END);
-	fwrite(bitmap,1280,1,fp);			//update bitmap
-	fseek(fp,h*512,SEEK_SET);			//go to the free block
-	//make a new entey
-	cs1550_directory_entry* new_dir = malloc(sizeof(cs1550_directory_entry));
-	new_dir->nFiles=0;
-	fwrite(new_dir,sizeof(cs1550_directory_entry),1,fp); //write the new entry to the disk
-	(void) path;
-	(void) mode;
-	fclose(fp);
-	free(root);
-	free(new_dir);
-	return 0;
+	pthread_mutex_unlock(&disk_queue_lock);
+	return NULL;
+}
+
+static void disk_workers_start(void){
+	pthread_mutex_lock(&disk_queue_lock);
+	disk_workers_stop = false;
+	while(nWorkers<nDisks){
+		pthread_cond_init(&disk_work_cond[nWorkers],NULL);
+		disk_queue[nWorkers] = NULL;
+		if(pthread_create(&disk_workers[nWorkers],NULL,disk_worker,(void*)(long)nWorkers)!=0){
+			break;	//disk_rw does it on its own then
+		}
+		nWorkers++;
+	}
+	pthread_mutex_unlock(&disk_queue_lock);
+}
+
+static void disk_workers_finish(void){
+	int k;
+	pthread_mutex_lock(&disk_queue_lock);
+	disk_workers_stop = true;
+	for(k=0;k<nWorkers;k++){
+		pthread_cond_signal(&disk_work_cond[k]);
+	}
+	pthread_mutex_unlock(&disk_queue_lock);
+	for(k=0;k<nWorkers;k++){
+		pthread_join(disk_workers[k],NULL);
+		pthread_cond_destroy(&disk_work_cond[k]);
+	}
+	nWorkers = 0;
+}
+
+/*
+ * Reads or writes n ranges of the volume. They are cut up at stripe unit
+ * boundaries and every backing file involved gets its share done by its
+ * worker, so a request that spans stripes is served by all of them at once.
+ */
+static int disk_rw(bool write,const struct disk_extent* ext,int n){
+	struct disk_segment local[16];
+	struct disk_segment* segs = local;
+	long stripe_size = (long)nStripeBlocks*BLOCK_SIZE;
+	int max_segs = 0;
+	int k;
+	for(k=0;k<n;k++){
+		max_segs += ext[k].len/stripe_size+2;
+	}
+	if(max_segs>16){
+		segs = malloc(max_segs*sizeof(struct disk_segment));
+	}
+	int nSegs = 0;
+	bool busy[MAX_DISKS];
+	memset(busy,0,sizeof(busy));
+	for(k=0;k<n;k++){
+		long offset = ext[k].offset;
+		char* buf = ext[k].buf;
+		size_t len = ext[k].len;
+		while(len>0){
+			long unit = offset/stripe_size;
+			long in_unit = offset%stripe_size;
+			size_t part = (size_t)(stripe_size-in_unit)<len ? (size_t)(stripe_size-in_unit) : len;
+			int disk = unit%nDisks;
+			off_t where = data_start+(unit/nDisks)*stripe_size+in_unit;
+			struct disk_segment* last = nSegs>0 ? &segs[nSegs-1] : NULL;
+			if(last!=NULL && last->disk==disk && last->offset+(off_t)last->len==where && last->buf+last->len==buf){
+				last->len += part;	//carries on where the last one stopped
+			}else{
+				segs[nSegs].disk = disk;
+				segs[nSegs].offset = where;
+				segs[nSegs].buf = buf;
+				segs[nSegs].len = part;
+				nSegs++;
+			}
+			busy[disk] = true;
+			offset += part;
+			buf += part;
+			len -= part;
+		}
+	}
+	struct disk_job jobs[MAX_DISKS];
+	bool queued[MAX_DISKS];
+	int first = -1;
+	pthread_mutex_lock(&disk_queue_lock);
+	for(k=0;k<nDisks;k++){
+		jobs[k].write = write;
+		jobs[k].disk = k;
+		jobs[k].segs = segs;
+		jobs[k].nSegs = nSegs;
+		jobs[k].res = 0;
+		jobs[k].done = false;
+		jobs[k].next = NULL;
+		queued[k] = false;
+		if(!busy[k]){
+			continue;
+		}
+		if(first<0 || k>=nWorkers){
+			if(first<0){
+				first = k;	//done on this thread
+			}
+			continue;
+		}
+		if(disk_queue[k]==NULL){
+			disk_queue[k] = &jobs[k];
+		}else{
+			disk_queue_tail[k]->next = &jobs[k];
+		}
+		disk_queue_tail[k] = &jobs[k];
+		queued[k] = true;
+		pthread_cond_signal(&disk_work_cond[k]);
+	}
+	pthread_mutex_unlock(&disk_queue_lock);
+	int res = 0;
+	for(k=0;k<nDisks;k++){
+		if(busy[k] && !queued[k]){	//this thread's, and any without a worker
+			disk_job_run(&jobs[k]);
+		}
+	}
+	pthread_mutex_lock(&disk_queue_lock);
+	for(k=0;k<nDisks;k++){
+		while(queued[k] && !jobs[k].done){
+			pthread_cond_wait(&disk_done_cond,&disk_queue_lock);
+		}
+	}
+	pthread_mutex_unlock(&disk_queue_lock);
+	for(k=0;k<nDisks;k++){
+		if(jobs[k].res<0){
+			res = jobs[k].res;
+		}
+	}
+	if(segs!=local){
+		free(segs);
+	}
+	return res;
+}
+
+//queues a range for a later disk_rw
+static void extent_add(struct disk_extent* ext,int* n,long offset,char* buf,size_t len){
+	ext[*n].offset = offset;
+	ext[*n].buf = buf;
+	ext[*n].len = len;
+	(*n)++;
+}
+
+static int disk_read(long offset,void* buf,size_t len){
+	struct disk_extent ext = {offset,buf,len};
+	return disk_rw(false,&ext,1);
+}
+
+static int disk_write(long offset,const void* buf,size_t len){
+	struct disk_extent ext = {offset,(char*)buf,len};
+	return disk_rw(true,&ext,1);
+}
+
+static void disks_close(void){
+	int k;
+	disk_workers_finish();
+	for(k=0;k<nDisks;k++){
+		close(disk_fds[k]);
+	}
+	nDisks = 0;
+	for(k=0;k<direct_pool_free;k++){
+		free(direct_pool[k]);
+	}
+	direct_pool_free = 0;
+	direct_align = 0;
+}
+
+/*
+ * Opens the backing files and works out the stripe layout. A striped set is
+ * labelled the first time it is used, as long as none of its files holds
+ * anything yet, and is put back in order from its labels after that.
+ */
+static int disks_open(void)
+{
+	char* names = strdup(options.disks!=NULL ? options.disks : ".disk");
+	char* paths[MAX_DISKS];
+	char* save;
+	char* path;
+	int n = 0;
+	int k;
+	for(path=strtok_r(names,":",&save);path!=NULL;path=strtok_r(NULL,":",&save)){
+		if(n==MAX_DISKS){
+			fprintf(stderr,"at most %d backing files\n",MAX_DISKS);
+			free(names);
+			return -1;
+		}
+		paths[n++] = path;
+	}
+	if(n==0){
+		fprintf(stderr,"no backing files given\n");
+		free(names);
+		return -1;
+	}
+	int stripe = options.stripe>0 ? options.stripe : DEFAULT_STRIPE_BLOCKS;
+	struct cs1550_disk_label labels[MAX_DISKS];
+	int fds[MAX_DISKS];
+	int labelled = 0;
+	int blank = 0;
+	int res = 0;
+	for(k=0;k<n;k++){
+		fds[k] = open(paths[k],O_RDWR | O_CREAT,0644);
+		if(fds[k]<0){
+			perror(paths[k]);
+			while(k-->0){
+				close(fds[k]);
+			}
+			free(names);
+			return -1;
+		}
+		memset(&labels[k],0,sizeof(struct cs1550_disk_label));
+		if(n>1 && pread(fds[k],&labels[k],sizeof(struct cs1550_disk_label),0)<0){
+			perror(paths[k]);
+			res = -1;
+		}
+		if(labels[k].magic==CS1550_MAGIC){
+			labelled++;
+		}else{
+			char zeros[BLOCK_SIZE];
+			memset(zeros,0,sizeof(zeros));
+			if(memcmp(&labels[k],zeros,BLOCK_SIZE)==0){
+				blank++;
+			}
+		}
+	}
+	nDisks = n;
+	for(k=0;k<n;k++){
+		disk_fds[k] = fds[k];
+	}
+	if(n==1){
+		nStripeBlocks = TOTAL_BLOCKS;
+		data_start = 0;
+	}else if(res==0 && labelled==0 && blank==n){	//a new set
+		nStripeBlocks = stripe;
+		data_start = LABEL_AREA;
+		for(k=0;k<n && res==0;k++){
+			labels[k].magic = CS1550_MAGIC;
+			labels[k].nDisk = k;
+			labels[k].nDisks = n;
+			labels[k].nStripeBlocks = stripe;
+			labels[k].nDataStart = LABEL_AREA;
+			if(pwrite(fds[k],&labels[k],sizeof(struct cs1550_disk_label),0)!=sizeof(struct cs1550_disk_label)){
+				perror(paths[k]);
+				res = -1;
+			}
+		}
+	}else if(res==0 && labelled==n){
+		nStripeBlocks = labels[0].nStripeBlocks;
+		data_start = labels[0].nDataStart!=0 ? labels[0].nDataStart : BLOCK_SIZE;
+		bool seen[MAX_DISKS];
+		memset(seen,0,sizeof(seen));
+		for(k=0;k<n && res==0;k++){
+			int d = labels[k].nDisk;
+			if(labels[k].nDisks!=n || labels[k].nStripeBlocks!=nStripeBlocks
+					|| labels[k].nDataStart!=labels[0].nDataStart || d<0 || d>=n || seen[d]){
+				fprintf(stderr,"%s doesn't belong to this set of %d backing files\n",paths[k],n);
+				res = -1;
+			}else{
+				seen[d] = true;
+				disk_fds[d] = fds[k];
+			}
+		}
+		if(res==0 && options.stripe>0 && options.stripe!=nStripeBlocks){
+			fprintf(stderr,"the set was made with stripe=%d\n",nStripeBlocks);
+			res = -1;
+		}
+	}else if(res==0){
+		fprintf(stderr,"the backing files are neither a set made before nor empty\n");
+		res = -1;
+	}
+	if(res==0){
+		//make room for this file's share of the volume, preallocated for
+		//O_DIRECT. A device has to be big enough already.
+		long units = (TOTAL_BLOCKS+nStripeBlocks-1)/nStripeBlocks;
+		off_t size = data_start+((units+n-1)/n)*nStripeBlocks*(off_t)BLOCK_SIZE;
+		for(k=0;k<n && res==0;k++){
+			struct stat st;
+			uint64_t device_size = 0;
+			if(fstat(disk_fds[k],&st)<0){
+				perror(paths[k]);
+				res = -1;
+			}else if(S_ISBLK(st.st_mode)){
+				if(ioctl(disk_fds[k],BLKGETSIZE64,&device_size)<0 || device_size<(uint64_t)size){
+					fprintf(stderr,"%s is smaller than the %ld bytes it needs\n",paths[k],(long)size);
+					res = -1;
+				}
+			}else if(S_ISREG(st.st_mode) && st.st_size<size){
+				int err = options.direct ? posix_fallocate(disk_fds[k],0,size) : 0;
+				if(err!=0 && err!=EOPNOTSUPP && err!=EINVAL){
+					fprintf(stderr,"%s: %s\n",paths[k],strerror(err));
+					res = -1;
+				}else if(err!=0 || !options.direct){
+					if(ftruncate(disk_fds[k],size)<0){
+						perror(paths[k]);
+						res = -1;
+					}
+				}
+			}
+		}
+	}
+	if(res==0 && options.direct){
+		res = direct_start(paths);
+	}
+	if(res<0){
+		disks_close();
+	}
+	free(names);
+	return res;
+}
+
+/*
+ * Blocks can be shared by several owners: data blocks by index entries,
+ * index blocks by clones, directory blocks by snapshots. refcounts[b] counts
+ * the owners of block b besides the first, so a block that was never shared
+ * needs no bookkeeping. The table is created on the first dedup mount, clone
+ * or snapshot and from then on is kept in memory. Changed blocks of it are
+ * written back along with the writes that changed them.
+ */
+#define	REF_TABLE_BLOCKS (TOTAL_BLOCKS / BLOCK_SIZE)
+#define	MAX_REFS 255
+
+static unsigned char* refcounts;	//NULL while the disk has no table
+static uint32_t refs_dirty;	//table blocks not written back yet, under alloc_lock
+
+/*
+ * Dedup fingerprint index: a hash of each full data block written in dedup
+ * mode, mapped to the block holding it. It is only a hint, a candidate is
+ * read back and compared before it is shared, so stale or colliding entries
+ * are harmless. Buckets of FINGERPRINT_WAYS entries, newest first.
+ */
+#define	FINGERPRINT_BUCKETS 1024
+#define	FINGERPRINT_WAYS 4
+
+struct cs1550_fingerprint
+{
+	unsigned short tag;		//more bits of the hash
+	unsigned short nBlock;	//NO_BLOCK for an empty way
+};
+
+#define	FINGERPRINT_TABLE_BLOCKS (FINGERPRINT_BUCKETS * FINGERPRINT_WAYS * sizeof(struct cs1550_fingerprint) / BLOCK_SIZE)
+
+static struct cs1550_fingerprint* fingerprints;	//NULL unless mounted with dedup
+static uint32_t fingerprints_dirty;	//table blocks not written back yet, under alloc_lock
+
+static unsigned long block_hash(const char* data){
+	unsigned long hash = 14695981039346656037UL;	//64 bit FNV-1a
+	int k;
+	for(k=0;k<BLOCK_SIZE;k++){
+		hash ^= (unsigned char)data[k];
+		hash *= 1099511628211UL;
+	}
+	return hash;
+}
+
+static struct cs1550_fingerprint* fingerprint_bucket(unsigned long hash){
+	return &fingerprints[(hash%FINGERPRINT_BUCKETS)*FINGERPRINT_WAYS];
+}
+
+//Held while changing the bitmap, the reference counts, the dedup index or
+//the usage counters, the background reclaimer does the first two at the same
+//time as the callbacks
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+//Held while creating the tables, and while writing changed table blocks back
+//so that they reach the disk in the order they were changed
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Dedup only shares blocks whose contents are settled: file data that has
+ * been written and published, and not claimed back by its owner since to be
+ * overwritten in place. block_gen moves on every time a block stops being
+ * shareable, so a candidate compared outside the lock can be checked for
+ * having changed in the meantime. Both are under alloc_lock.
+ */
+static char dedup_shareable[BITMAP_BYTES];
+static unsigned int block_gen[TOTAL_BLOCKS];
+
+static bool block_is_shareable(long block){
+	return (dedup_shareable[block/8]>>(block%8)) & 1;
+}
+
+static void block_unpublish(long block){
+	dedup_shareable[block/8] &= ~(1<<(block%8));
+	block_gen[block]++;
+}
+
+static int ref_count(long block){
+	return refcounts==NULL ? 0 : refcounts[block];
+}
+
+//true if block has other owners besides the caller, for callers not
+//holding alloc_lock
+static bool ref_shared(long block){
+	pthread_mutex_lock(&alloc_lock);
+	bool shared = ref_count(block)>0;
+	pthread_mutex_unlock(&alloc_lock);
+	return shared;
+}
+
+//marks the block of the table that holds the count for block for writing back
+static void ref_sync(long block){
+	refs_dirty |= (uint32_t)1<<(block/BLOCK_SIZE);
+}
+
+//drops one reference to block, true if that was the last one and the
+//caller should free it
+static bool ref_drop(long block){
+	bool last = true;
+	pthread_mutex_lock(&alloc_lock);
+	if(ref_count(block)>0){
+		refcounts[block]--;
+		ref_sync(block);
+		last = false;
+	}else{
+		block_unpublish(block);	//on its way back to the bitmap
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return last;
+}
+
+//true if the caller is the only owner of block and may overwrite it in
+//place. Dedup can't hand it out again until it is published anew.
+static bool block_claim(long block){
+	bool mine = false;
+	pthread_mutex_lock(&alloc_lock);
+	if(ref_count(block)==0){
+		block_unpublish(block);
+		mine = true;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return mine;
+}
+
+/*
+ * Changed blocks of the reference count table and the fingerprint index are
+ * written back together, once per batch of data blocks rather than once per
+ * change. tables_collect copies them out under alloc_lock and adds them to
+ * ext. If there were any it returns the copy with table_lock held, which the
+ * caller gives to tables_done once they are written.
+ */
+#define	TABLE_BLOCKS_MAX (REF_TABLE_BLOCKS + FINGERPRINT_TABLE_BLOCKS)
+
+static char* tables_collect(struct disk_extent* ext,int* n){
+	if(refcounts==NULL && fingerprints==NULL){
+		return NULL;
+	}
+	pthread_mutex_lock(&table_lock);
+	pthread_mutex_lock(&alloc_lock);
+	if(refs_dirty==0 && fingerprints_dirty==0){
+		pthread_mutex_unlock(&alloc_lock);
+		pthread_mutex_unlock(&table_lock);
+		return NULL;
+	}
+	char* copy = block_alloc(TABLE_BLOCKS_MAX*BLOCK_SIZE);
+	char* next = copy;
+	int k;
+	for(k=0;k<REF_TABLE_BLOCKS;k++){
+		if(refs_dirty & ((uint32_t)1<<k)){
+			memcpy(next,refcounts+k*BLOCK_SIZE,BLOCK_SIZE);
+			extent_add(ext,n,(superblock.nRefBlock+k)*512,next,BLOCK_SIZE);
+			next += BLOCK_SIZE;
+		}
+	}
+	for(k=0;k<(int)FINGERPRINT_TABLE_BLOCKS;k++){
+		if(fingerprints_dirty & ((uint32_t)1<<k)){
+			memcpy(next,(char*)fingerprints+k*BLOCK_SIZE,BLOCK_SIZE);
+			extent_add(ext,n,(superblock.nFingerprintBlock+k)*512,next,BLOCK_SIZE);
+			next += BLOCK_SIZE;
+		}
+	}
+	refs_dirty = 0;
+	fingerprints_dirty = 0;
+	pthread_mutex_unlock(&alloc_lock);
+	return copy;
+}
+
+static void tables_done(char* copy){
+	if(copy!=NULL){
+		free(copy);
+		pthread_mutex_unlock(&table_lock);
+	}
+}
+
+//writes back whatever table blocks have changed
+static void tables_flush(void){
+	struct disk_extent ext[TABLE_BLOCKS_MAX];
+	int n = 0;
+	char* copy = tables_collect(ext,&n);
+	if(copy!=NULL){
+		disk_rw(true,ext,n);
+		tables_done(copy);
+	}
+}
+
+//makes freshly written data blocks available to dedup
+static void blocks_publish(const long* blocks,int n){
+	int k;
+	pthread_mutex_lock(&alloc_lock);
+	for(k=0;k<n;k++){
+		dedup_shareable[blocks[k]/8] |= 1<<(blocks[k]%8);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+//a reference for one more owner of block, false if it can't take any more
+static bool ref_take(long block){
+	bool taken = false;
+	pthread_mutex_lock(&alloc_lock);
+	if(refcounts!=NULL && refcounts[block]<MAX_REFS){
+		refcounts[block]++;
+		ref_sync(block);
+		taken = true;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return taken;
+}
+
+static void superblock_write(void)
+{
+	pthread_mutex_lock(&alloc_lock);	//the bitmap writes carry a copy as well
+	disk_write(SUPERBLOCK_OFFSET,&superblock,sizeof(cs1550_superblock));
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+//points the superblock at a table. Under alloc_lock, so a bitmap write never copies it half done.
+static void superblock_set(long* field,long block)
+{
+	pthread_mutex_lock(&alloc_lock);
+	*field = block;
+	disk_write(SUPERBLOCK_OFFSET,&superblock,sizeof(cs1550_superblock));
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+//bumps one of the usage counters in the superblock
+static void usage_count(long* counter,int delta){
+	pthread_mutex_lock(&alloc_lock);
+	*counter += delta;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not.
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+
+//helper functions for bitmap operations
+//check if the given bit in the bitNum is 0
+static bool checkBit(int bitNum,int bitIndex){
+	return ((bitNum >> bitIndex) & 1) == 0;	//true if this bit is 'free'
+}
+//sets the given index bit to 1
+static char setBit(int bitNum,int bitIndex){
+	return bitNum | (1<<bitIndex);
+}
+//sets the given index bit to 0
+static char resetBit(int bitNum,int bitIndex){
+	return bitNum & ~(1<<bitIndex);
+}
+
+/*
+ * Background reclaimer. unlink and rmdir take the entry out of its directory
+ * right away and queue the blocks it owned here. A thread gives them back to
+ * the bitmap in batches, so deleting lots of files costs a bitmap update
+ * every so often instead of one per block.
+ */
+#define	RECLAIM_BATCH 256		//wake the reclaimer early once this many are queued
+#define	RECLAIM_DELAY_MS 100	//otherwise collect for this long
+
+static long reclaim_queue[TOTAL_BLOCKS];
+static int reclaim_count;
+static char reclaim_pending[BITMAP_BYTES];	//set for the blocks in the queue
+static bool reclaim_stop;
+static pthread_t reclaim_thread;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+static bool reclaim_busy;	//a batch is out of the queue but not in the bitmap yet
+static pthread_cond_t reclaim_done_cond = PTHREAD_COND_INITIALIZER;
+
+//The bitmap is read and written in whole blocks, the last one of which ends
+//with the superblock, so that goes out with it. Both under alloc_lock.
+static void bitmap_load(char* area){
+	disk_read(BITMAP_OFFSET,area,BITMAP_AREA);
+}
+
+static void bitmap_store(char* area){
+	memcpy(area+BITMAP_BYTES,&superblock,sizeof(cs1550_superblock));
+	disk_write(BITMAP_OFFSET,area,BITMAP_AREA);
+}
+
+//For an allocation that came up short, under alloc_lock: waits out the batch
+//the reclaimer is giving back, reloads the bitmap and frees whatever is still
+//queued in it, for the caller to store. False if nothing was on its way back.
+static bool reclaim_drain(char* bitmap){
+	if(reclaim_count==0 && !reclaim_busy){
+		return false;
+	}
+	while(reclaim_busy){
+		pthread_cond_wait(&reclaim_done_cond,&alloc_lock);
+	}
+	bitmap_load(bitmap);
+	int k;
+	for(k=0;k<reclaim_count;k++){
+		long block = reclaim_queue[k];
+		if(!checkBit(bitmap[block/8],block%8)){
+			superblock.nFreeBlocks++;
+		}
+		block_unpublish(block);
+		bitmap[block/8] = resetBit(bitmap[block/8],block%8);
+		reclaim_pending[block/8] = resetBit(reclaim_pending[block/8],block%8);
+	}
+	reclaim_count = 0;
+	return true;
+}
+
+//allocates n blocks with a single read-modify-write of the bitmap
+//either all n are allocated into blocks[] or none are
+static int bitmap_alloc(long* blocks,int n){
+	if(n<=0){
+		return 0;	//nothing to do, so don't touch the bitmap at all
+	}
+	char bitmap[BITMAP_AREA] __attribute__((aligned(BUFFER_ALIGN)));
+	pthread_mutex_lock(&alloc_lock);
+	bitmap_load(bitmap);
+	bool drained = false;
+	int k;
+	int found;
+	for(;;){
+		found = 0;
+		for(k=0;k<TOTAL_BLOCKS && found<n;k++){
+			//a block somebody still holds a reference to is never free
+			if(checkBit(bitmap[k/8],k%8) && ref_count(k)==0){
+				blocks[found++] = k;
+			}
+		}
+		if(found==n || !reclaim_drain(bitmap)){
+			break;
+		}
+		drained = true;	//try again with the blocks that were waiting to be freed
+	}
+	if(found<n){
+		if(drained){
+			bitmap_store(bitmap);	//what came back from the queue is free all the same
+		}
+		pthread_mutex_unlock(&alloc_lock);
+		return -ENOSPC;
+	}
+	for(k=0;k<n;k++){
+		bitmap[blocks[k]/8]=setBit(bitmap[blocks[k]/8],blocks[k]%8);		//used
+	}
+	superblock.nFreeBlocks -= n;
+	//update the bitmap
+	bitmap_store(bitmap);
+	pthread_mutex_unlock(&alloc_lock);
+	return 0;
+}
+
+static int bitmap_find(void){
+	long block;
+	if(bitmap_alloc(&block,1)<0){
+		return -1;	//not found
+	}
+	return block;
+}
+
+//allocates n consecutive blocks and returns the first one
+static long bitmap_alloc_run(int n){
+	char bitmap[BITMAP_AREA] __attribute__((aligned(BUFFER_ALIGN)));
+	pthread_mutex_lock(&alloc_lock);
+	bitmap_load(bitmap);
+	bool drained = false;
+	int k;
+	int run;
+	for(;;){
+		run = 0;
+		for(k=0;k<TOTAL_BLOCKS && run<n;k++){
+			if(checkBit(bitmap[k/8],k%8) && ref_count(k)==0){
+				run++;
+			}else{
+				run = 0;
+			}
+		}
+		if(run==n || !reclaim_drain(bitmap)){
+			break;
+		}
+		drained = true;
+	}
+	if(run<n){
+		if(drained){
+			bitmap_store(bitmap);
+		}
+		pthread_mutex_unlock(&alloc_lock);
+		return -ENOSPC;
+	}
+	long start = k-n;
+	for(k=start;k<start+n;k++){
+		bitmap[k/8]=setBit(bitmap[k/8],k%8);
+	}
+	superblock.nFreeBlocks -= n;
+	bitmap_store(bitmap);
+	pthread_mutex_unlock(&alloc_lock);
+	return start;
+}
+
+//gives n blocks back to the bitmap, again with one read-modify-write
+static void bitmap_release(const long* blocks,int n){
+	if(n<=0){
+		return;
+	}
+	char bitmap[BITMAP_AREA] __attribute__((aligned(BUFFER_ALIGN)));
+	pthread_mutex_lock(&alloc_lock);
+	bitmap_load(bitmap);
+	int k;
+	for(k=0;k<n;k++){
+		if(!checkBit(bitmap[blocks[k]/8],blocks[k]%8)){
+			superblock.nFreeBlocks++;
+		}
+		block_unpublish(blocks[k]);
+		bitmap[blocks[k]/8]=resetBit(bitmap[blocks[k]/8],blocks[k]%8);
+	}
+	bitmap_store(bitmap);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+//allocates and zeroes n consecutive blocks for an on-disk table
+static long table_create(int n)
+{
+	long start = bitmap_alloc_run(n);
+	if(start<0){
+		return start;
+	}
+	char* zeros = block_alloc(n*BLOCK_SIZE);
+	memset(zeros,0,n*BLOCK_SIZE);
+	disk_write(start*512,zeros,n*BLOCK_SIZE);
+	free(zeros);
+	return start;
+}
+
+//creates the reference count table the first time anything is shared
+static int refs_ensure(void)
+{
+	int res = 0;
+	pthread_mutex_lock(&table_lock);
+	if(refcounts==NULL){
+		long start = table_create(REF_TABLE_BLOCKS);
+		if(start<0){
+			res = start;
+		}else{
+			unsigned char* table = block_alloc(REF_TABLE_BLOCKS*BLOCK_SIZE);
+			memset(table,0,REF_TABLE_BLOCKS*BLOCK_SIZE);
+			superblock_set(&superblock.nRefBlock,start);
+			refcounts = table;
+		}
+	}
+	pthread_mutex_unlock(&table_lock);
+	return res;
+}
+
+static bool reclaim_is_pending(long block){
+	return !checkBit(reclaim_pending[block/8],block%8);
+}
+
+//drops the caller's reference to block, queueing it if that was the last
+static void reclaim_block(long block){
+	if(block==NO_BLOCK || !ref_drop(block)){
+		return;
+	}
+	pthread_mutex_lock(&alloc_lock);
+	reclaim_pending[block/8] = setBit(reclaim_pending[block/8],block%8);
+	reclaim_queue[reclaim_count++] = block;
+	if(reclaim_count>=RECLAIM_BATCH){
+		pthread_cond_signal(&reclaim_cond);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+static void* reclaim_main(void* arg){
+	(void) arg;
+	long* batch = malloc(sizeof(reclaim_queue));
+	pthread_mutex_lock(&alloc_lock);
+	while(!reclaim_stop || reclaim_count>0){
+		if(reclaim_count<RECLAIM_BATCH && !reclaim_stop){
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME,&until);
+			until.tv_nsec += RECLAIM_DELAY_MS*1000000L;
+			until.tv_sec += until.tv_nsec/1000000000L;
+			until.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&reclaim_cond,&alloc_lock,&until);
+		}
+		int n = reclaim_count;
+		if(n==0){
+			continue;
+		}
+		memcpy(batch,reclaim_queue,n*sizeof(long));
+		reclaim_count = 0;
+		reclaim_busy = true;
+		pthread_mutex_unlock(&alloc_lock);
+
+		bitmap_release(batch,n);
+
+		pthread_mutex_lock(&alloc_lock);
+		int k;
+		for(k=0;k<n;k++){
+			reclaim_pending[batch[k]/8] = resetBit(reclaim_pending[batch[k]/8],batch[k]%8);
+		}
+		reclaim_busy = false;
+		pthread_cond_broadcast(&reclaim_done_cond);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	free(batch);
+	return NULL;
+}
+
+static void reclaim_start(void){
+	reclaim_stop = false;
+	pthread_create(&reclaim_thread,NULL,reclaim_main,NULL);
+}
+
+//hands back whatever is still queued and stops the thread
+static void reclaim_finish(void){
+	pthread_mutex_lock(&alloc_lock);
+	reclaim_stop = true;
+	pthread_cond_signal(&reclaim_cond);
+	pthread_mutex_unlock(&alloc_lock);
+	pthread_join(reclaim_thread,NULL);
+}
+
+//takes another reference to a block found by dedup, as long as it still
+//holds what was compared, which it does while its generation is unchanged
+static bool ref_share(long block,unsigned int gen){
+	bool shared = false;
+	pthread_mutex_lock(&alloc_lock);
+	if(refcounts!=NULL && refcounts[block]<MAX_REFS && block_is_shareable(block) && block_gen[block]==gen
+			&& !reclaim_is_pending(block)){
+		refcounts[block]++;
+		ref_sync(block);
+		shared = true;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return shared;
+}
+
+/*
+ * Blocks reserved and given up while rewriting part of a file, so that the
+ * bitmap is read and written once for all of them.
+ */
+#define	MAX_BATCH (2 * MAX_ENTRIES_IN_INDEX_BLOCK)
+
+struct block_batch
+{
+	long fresh[MAX_BATCH];	//reserved blocks, fresh[used] onwards are still unused
+	int nFresh;
+	int used;
+	long freed[MAX_BATCH];	//blocks to give back to the bitmap
+	int nFreed;
+};
+
+//reserves n blocks for the entries that will need a new one when written
+static int batch_reserve(struct block_batch* batch,int n){
+	if(bitmap_alloc(batch->fresh,n)<0){
+		return -ENOSPC;
+	}
+	batch->nFresh = n;
+	batch->used = 0;
+	return 0;
+}
+
+static long batch_take(struct block_batch* batch){
+	if(batch->used<batch->nFresh){
+		return batch->fresh[batch->used++];
+	}
+	return bitmap_find();	//a block became shared while we were at it
+}
+
+//drops one reference to block, it is freed once nobody else holds it
+static void batch_drop(struct block_batch* batch,long block){
+	if(block!=NO_BLOCK && ref_drop(block)){
+		batch->freed[batch->nFreed++] = block;
+	}
+}
+
+static void batch_finish(struct block_batch* batch){
+	while(batch->used<batch->nFresh){
+		batch->freed[batch->nFreed++] = batch->fresh[batch->used++];
+	}
+	bitmap_release(batch->freed,batch->nFreed);
+	tables_flush();	//for the references dropped after put_blocks
+}
+
+//the newest shareable block whose fingerprint matches hash, NO_BLOCK if there
+//is none. gen is what it has to still be for the block to be shared.
+static long dedup_probe(unsigned long hash,unsigned int* gen){
+	struct cs1550_fingerprint* bucket = fingerprint_bucket(hash);
+	long block = NO_BLOCK;
+	int w;
+	pthread_mutex_lock(&alloc_lock);
+	for(w=0;w<FINGERPRINT_WAYS && block==NO_BLOCK;w++){
+		if(bucket[w].nBlock!=NO_BLOCK && bucket[w].tag==(unsigned short)(hash>>48)
+				&& block_is_shareable(bucket[w].nBlock)){
+			block = bucket[w].nBlock;
+			*gen = block_gen[block];
+		}
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return block;
+}
+
+//finds a block on disk holding exactly data and takes a reference to it for
+//the caller, -1 if there is none. current is the caller's own block, which
+//needs no new reference. skip has already been looked at.
+static long dedup_find(unsigned long hash,const char* data,long current,long skip){
+	struct cs1550_fingerprint bucket[FINGERPRINT_WAYS];
+	unsigned int gen[FINGERPRINT_WAYS];
+	bool shareable[FINGERPRINT_WAYS];
+	unsigned short tag = hash>>48;
+	char candidate[BLOCK_SIZE] __attribute__((aligned(BUFFER_ALIGN)));
+	int w;
+	pthread_mutex_lock(&alloc_lock);
+	memcpy(bucket,fingerprint_bucket(hash),sizeof(bucket));
+	for(w=0;w<FINGERPRINT_WAYS;w++){
+		gen[w] = block_gen[bucket[w].nBlock];
+		shareable[w] = block_is_shareable(bucket[w].nBlock);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	for(w=0;w<FINGERPRINT_WAYS;w++){
+		long block = bucket[w].nBlock;
+		//a block that isn't shareable isn't written yet, or is being overwritten
+		if(block==NO_BLOCK || block==skip || bucket[w].tag!=tag || !shareable[w]){
+			continue;
+		}
+		disk_read(block*512,candidate,BLOCK_SIZE);
+		if(memcmp(candidate,data,BLOCK_SIZE)==0 && (block==current || ref_share(block,gen[w]))){
+			return block;
+		}
+	}
+	return -1;
+}
+
+static void dedup_insert(unsigned long hash,long block){
+	unsigned short tag = hash>>48;
+	int w;
+	pthread_mutex_lock(&alloc_lock);
+	struct cs1550_fingerprint* bucket = fingerprint_bucket(hash);
+	for(w=0;w<FINGERPRINT_WAYS-1;w++){
+		if(bucket[w].nBlock==block && bucket[w].tag==tag){
+			pthread_mutex_unlock(&alloc_lock);
+			return;	//already the newest
+		}
+	}
+	memmove(bucket+1,bucket,(FINGERPRINT_WAYS-1)*sizeof(struct cs1550_fingerprint));
+	bucket[0].tag = tag;
+	bucket[0].nBlock = block;
+	fingerprints_dirty |= (uint32_t)1<<(((char*)bucket-(char*)fingerprints)/BLOCK_SIZE);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Writes n blocks of file data for the index entries e[0..n), the first full
+ * of which are completely covered by the file. A block shared with others is
+ * copied rather than overwritten, and in dedup mode a full block that is
+ * already on disk is shared instead of written again.
+ */
+static int put_blocks(struct block_batch* batch,long* e,const char* data,int n,int full){
+	//written together at the end, along with the table blocks this changed
+	struct disk_extent* pending = calloc(n+TABLE_BLOCKS_MAX,sizeof(struct disk_extent));
+	unsigned long* hash = malloc(n*sizeof(unsigned long));
+	long* found = malloc(n*sizeof(long));	//what dedup turned up, -1 for nothing
+	int* same = malloc(n*sizeof(int));		//an earlier block of ours with the same data, -1 for none
+	long* fingerprinted = malloc(n*sizeof(long));	//published for dedup once they are on disk
+	unsigned int* gen = malloc(n*sizeof(unsigned int));
+	char* candidates = block_alloc(n*BLOCK_SIZE);
+	int nPending = 0;
+	int nFingerprinted = 0;
+	int need = 0;
+	int res = 0;
+	int k;
+	int j;
+	//the likeliest match for every block is read in one go
+	for(k=0;k<n;k++){
+		found[k] = NO_BLOCK;
+		if(fingerprints!=NULL && k<full){
+			hash[k] = block_hash(data+k*BLOCK_SIZE);
+			found[k] = dedup_probe(hash[k],&gen[k]);
+			if(found[k]!=NO_BLOCK){
+				extent_add(pending,&nPending,found[k]*512,candidates+k*BLOCK_SIZE,BLOCK_SIZE);
+			}
+		}
+	}
+	disk_rw(false,pending,nPending);
+	nPending = 0;
+	//then look everything up, so only the blocks that really need a new block
+	//get one, all in one go. A full disk leaves the entries as they were.
+	for(k=0;k<n;k++){
+		long current = ENTRY_BLOCK(e[k]);
+		long probe = found[k];
+		found[k] = -1;
+		same[k] = -1;
+		if(probe!=NO_BLOCK){
+			if(memcmp(candidates+k*BLOCK_SIZE,data+k*BLOCK_SIZE,BLOCK_SIZE)==0
+					&& (probe==current || ref_share(probe,gen[k]))){
+				found[k] = probe;
+			}else{
+				found[k] = dedup_find(hash[k],data+k*BLOCK_SIZE,current,probe);
+			}
+		}
+		if(fingerprints!=NULL && k<full){
+			for(j=0;j<k && found[k]<0 && same[k]<0;j++){
+				if(found[j]<0 && same[j]<0 && hash[j]==hash[k]
+						&& memcmp(data+j*BLOCK_SIZE,data+k*BLOCK_SIZE,BLOCK_SIZE)==0){
+					same[k] = j;
+				}
+			}
+		}
+		if(found[k]<0 && same[k]<0 && (current==NO_BLOCK || ref_shared(current))){
+			need++;
+		}
+	}
+	if(batch_reserve(batch,need)<0){
+		for(k=0;k<n;k++){
+			if(found[k]>=0 && found[k]!=ENTRY_BLOCK(e[k])){
+				batch_drop(batch,found[k]);
+			}
+		}
+		res = -ENOSPC;
+		n = 0;
+	}
+	for(k=0;k<n;k++){
+		long current = ENTRY_BLOCK(e[k]);
+		long block = found[k];
+		if(block<0 && same[k]>=0 && ref_take(ENTRY_BLOCK(e[same[k]]))){
+			block = ENTRY_BLOCK(e[same[k]]);
+		}
+		if(block>=0){
+			if(block!=current){
+				batch_drop(batch,current);
+			}
+			e[k] = block;
+			continue;
+		}
+		block = current;
+		if(current==NO_BLOCK || !block_claim(current)){	//copy on write
+			block = batch_take(batch);
+			if(block<0){
+				res = -ENOSPC;
+				break;
+			}
+			batch_drop(batch,current);
+		}
+		extent_add(pending,&nPending,block*512,(char*)data+k*BLOCK_SIZE,BLOCK_SIZE);
+		if(fingerprints!=NULL && k<full){
+			dedup_insert(hash[k],block);
+			fingerprinted[nFingerprinted++] = block;
+		}
+		e[k] = block;
+	}
+	char* tables = tables_collect(pending,&nPending);
+	int written = disk_rw(true,pending,nPending);
+	tables_done(tables);
+	if(written==0){
+		blocks_publish(fingerprinted,nFingerprinted);
+	}
+	free(candidates);
+	free(gen);
+	free(fingerprinted);
+	free(same);
+	free(found);
+	free(hash);
+	free(pending);
+	return res<0 ? res : written;
+}
+
+/*
+ * A small LZ77 codec for compression mode. The compressed stream is a list
+ * of tokens: a token below 0x80 is followed by token+1 literal bytes, any
+ * other token is a match of (token & 0x7f) + MIN_MATCH bytes copied from the
+ * distance stored in the next two bytes (little endian).
+ */
+#define	MIN_MATCH 3
+#define	MAX_MATCH (0x7f + MIN_MATCH)
+#define	MAX_LITERALS 0x80
+#define	HASH_BITS 10
+
+static int lz_literals(const unsigned char* in,int len,unsigned char* out,int* op,int out_max){
+	while(len>0){
+		int run = len>MAX_LITERALS ? MAX_LITERALS : len;
+		if(*op+1+run>out_max){
+			return -1;
+		}
+		out[(*op)++] = run-1;
+		memcpy(out+*op,in,run);
+		*op += run;
+		in += run;
+		len -= run;
+	}
+	return 0;
+}
+
+//returns the compressed length, or -1 if it doesn't fit in out_max bytes
+static int lz_compress(const unsigned char* in,int len,unsigned char* out,int out_max){
+	unsigned short last_seen[1<<HASH_BITS];	//position+1 of the last 3 bytes with this hash
+	memset(last_seen,0,sizeof(last_seen));
+	int ip = 0;
+	int op = 0;
+	int literal_start = 0;
+	while(ip+MIN_MATCH<=len){
+		unsigned int hash = ((in[ip]<<16 | in[ip+1]<<8 | in[ip+2]) * 2654435761u) >> (32-HASH_BITS);
+		int candidate = last_seen[hash]-1;
+		last_seen[hash] = ip+1;
+		if(candidate<0 || memcmp(in+candidate,in+ip,MIN_MATCH)!=0){
+			ip++;
+			continue;
+		}
+		int match = MIN_MATCH;
+		while(ip+match<len && match<MAX_MATCH && in[candidate+match]==in[ip+match]){
+			match++;
+		}
+		if(lz_literals(in+literal_start,ip-literal_start,out,&op,out_max)<0 || op+3>out_max){
+			return -1;
+		}
+		out[op++] = 0x80 | (match-MIN_MATCH);
+		out[op++] = (ip-candidate) & 0xff;
+		out[op++] = (ip-candidate) >> 8;
+		ip += match;
+		literal_start = ip;
+	}
+	if(lz_literals(in+literal_start,len-literal_start,out,&op,out_max)<0){
+		return -1;
+	}
+	return op;
+}
+
+//returns the decompressed length, or -1 if the stream is corrupt
+static int lz_decompress(const unsigned char* in,int len,unsigned char* out,int out_max){
+	int ip = 0;
+	int op = 0;
+	while(ip<len){
+		int token = in[ip++];
+		if(token<0x80){
+			int run = token+1;
+			if(ip+run>len || op+run>out_max){
+				return -1;
+			}
+			memcpy(out+op,in+ip,run);
+			ip += run;
+			op += run;
+		}else{
+			int match = (token & 0x7f)+MIN_MATCH;
+			if(ip+2>len){
+				return -1;
+			}
+			int distance = in[ip] | in[ip+1]<<8;
+			ip += 2;
+			if(distance==0 || distance>op || op+match>out_max){
+				return -1;
+			}
+			while(match--){	//byte by byte, matches may overlap themselves
+				out[op] = out[op-distance];
+				op++;
+			}
+		}
+	}
+	return op;
+}
+
+/*
+ * Cache of decompressed clusters, so that reading a compressed file a few
+ * bytes at a time doesn't decompress the same cluster over and over.
+ * Slots are keyed by the file's index block and the cluster number.
+ */
+#define	CACHE_SLOTS 32
+
+struct cluster_cache_slot
+{
+	long nIndexBlock;	//NO_BLOCK if the slot is empty
+	int cluster;
+	char data[CLUSTER_SIZE] __attribute__((aligned(BUFFER_ALIGN)));
+};
+
+static struct cluster_cache_slot cluster_cache[CACHE_SLOTS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct cluster_cache_slot* cache_slot(long index_block,int cluster){
+	return &cluster_cache[(index_block*(MAX_ENTRIES_IN_INDEX_BLOCK/CLUSTER_BLOCKS)+cluster)%CACHE_SLOTS];
+}
+
+static bool cache_get(long index_block,int cluster,char* buf){
+	bool hit = false;
+	pthread_mutex_lock(&cache_lock);
+	struct cluster_cache_slot* slot = cache_slot(index_block,cluster);
+	if(slot->nIndexBlock==index_block && slot->cluster==cluster){
+		memcpy(buf,slot->data,CLUSTER_SIZE);
+		hit = true;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return hit;
+}
+
+static void cache_put(long index_block,int cluster,const char* buf){
+	pthread_mutex_lock(&cache_lock);
+	struct cluster_cache_slot* slot = cache_slot(index_block,cluster);
+	slot->nIndexBlock = index_block;
+	slot->cluster = cluster;
+	memcpy(slot->data,buf,CLUSTER_SIZE);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_drop(long index_block,int cluster){
+	pthread_mutex_lock(&cache_lock);
+	struct cluster_cache_slot* slot = cache_slot(index_block,cluster);
+	if(slot->nIndexBlock==index_block && slot->cluster==cluster){
+		slot->nIndexBlock = NO_BLOCK;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+//forgets every cluster of a file that is going away
+static void cache_drop_file(long index_block){
+	int c;
+	for(c=0;c<(int)(MAX_ENTRIES_IN_INDEX_BLOCK/CLUSTER_BLOCKS);c++){
+		cache_drop(index_block,c);
+	}
+}
+
+//Argument of the ioctls: a path in the volume for a clone, a snapshot name
+struct cs1550_ioctl_arg
+{
+	char path[32];
+};
+
+#define	CS1550_IOC_CLONE _IOW('c', 1, struct cs1550_ioctl_arg)
+#define	CS1550_IOC_SNAPSHOT _IOW('c', 2, struct cs1550_ioctl_arg)
+#define	CS1550_IOC_SNAPSHOT_DELETE _IOW('c', 3, struct cs1550_ioctl_arg)
+
+//Where the root being looked at is. Block 0 normally, the snapshot's own
+//copy of the root when a snapshot is mounted, and then nothing can change.
+static long root_block = 0;
+static bool read_only;
+
+//Held while the live root is read, changed and written back
+static pthread_mutex_t root_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Held from reading a directory block to writing it back, so that a change
+//to one file can't put back an older copy of the others. Picked by the
+//directory's name, its block moves when it is unshared. Taken before
+//root_lock.
+#define	DIR_LOCKS 32
+static pthread_mutex_t dir_locks[DIR_LOCKS] = {[0 ... DIR_LOCKS-1] = PTHREAD_MUTEX_INITIALIZER};
+
+//the lock of the directory path is in
+static pthread_mutex_t* dir_lock_of(const char* path){
+	unsigned int hash = 5381;
+	const char* c;
+	for(c=path+1;*c!='\0' && *c!='/';c++){
+		hash = hash*33+(unsigned char)*c;
+	}
+	return &dir_locks[hash%DIR_LOCKS];
+}
+
+/*
+ * Looks up the file named by path. On success root and dir hold the blocks
+ * read from disk and *di, *fi are the positions of the file in them.
+ */
+static int find_file(const char* path,cs1550_root_directory* root,
+			cs1550_directory_entry* dir,int* di,int* fi)
+{
+	char dir_name[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+	memset(ext,0,sizeof(ext));
+	int valid_name = sscanf(path, "/%[^/]/%[^.].%s", dir_name, filename, ext);
+	if(valid_name==1){
+		return -EISDIR;
+	}
+	if(valid_name<2){
+		return -ENOENT;
+	}
+	disk_read(512*root_block,root,sizeof(cs1550_root_directory));
+	int i;
+	int j;
+	for(i=0;i<root->nDirectories;i++){
+		if(strcmp(root->directories[i].dname,dir_name)==0){
+			break;
+		}
+	}
+	if(i==root->nDirectories){	//path doesn't exist
+		return -ENOENT;
+	}
+	disk_read(512*root->directories[i].nStartBlock,dir,sizeof(cs1550_directory_entry));
+	for(j=0;j<dir->nFiles;j++){
+		if(strcmp(dir->files[j].fname,filename)==0 && strcmp(dir->files[j].fext,ext)==0){
+			*di = i;
+			*fi = j;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+//drops a reference to an index block, and to its data blocks too if that
+//was the last one
+static void release_index(long index_block){
+	cache_drop_file(index_block);
+	if(ref_count(index_block)>0){	//somebody else still uses the whole index block
+		reclaim_block(index_block);
+		tables_flush();
+		return;
+	}
+	cs1550_index_block* index_blk = block_alloc(sizeof(cs1550_index_block));
+	disk_read(512*index_block,index_blk,sizeof(cs1550_index_block));
+	int k;
+	for(k=0;k<(int)MAX_ENTRIES_IN_INDEX_BLOCK;k++){
+		reclaim_block(ENTRY_BLOCK(index_blk->entries[k]));
+	}
+	reclaim_block(index_block);
+	free(index_blk);
+	tables_flush();
+}
+
+//same for a directory block and everything in it
+static void release_dir(long dir_block){
+	if(ref_count(dir_block)>0){
+		reclaim_block(dir_block);
+		tables_flush();
+		return;
+	}
+	cs1550_directory_entry* dir = block_alloc(sizeof(cs1550_directory_entry));
+	disk_read(512*dir_block,dir,sizeof(cs1550_directory_entry));
+	int j;
+	for(j=0;j<dir->nFiles;j++){
+		release_index(dir->files[j].nIndexBlock);
+	}
+	reclaim_block(dir_block);
+	free(dir);
+	tables_flush();
+}
+
+/*
+ * Clones and snapshots share blocks instead of copying them. A clone of a
+ * file is a second directory entry for the same index block, a snapshot is
+ * a copy of the root pointing at the same directory blocks. Each shared
+ * block holds a reference for every extra owner. Before anything is changed
+ * the path to it is unshared one level at a time: the live root gets its
+ * own copy of a directory block, holding a reference to each index block
+ * in it, and a file gets its own copy of its index block, holding a
+ * reference to each data block. Data blocks themselves are copied by
+ * put_blocks when they are written.
+ */
+static int dir_unshare(cs1550_root_directory* root,int i,cs1550_directory_entry* dir){
+	long old = root->directories[i].nStartBlock;
+	if(ref_count(old)==0){
+		return 0;
+	}
+	long block = bitmap_find();
+	if(block<0){
+		return -ENOSPC;
+	}
+	int j;
+	for(j=0;j<dir->nFiles;j++){
+		if(!ref_take(dir->files[j].nIndexBlock)){
+			while(j-->0){
+				ref_drop(dir->files[j].nIndexBlock);
+			}
+			bitmap_release(&block,1);
+			return -EMLINK;
+		}
+	}
+	tables_flush();	//the new references are on disk before anything relies on them
+	disk_write(512*block,dir,sizeof(cs1550_directory_entry));
+	//somebody may have changed the root since the caller read it, or even
+	//unshared this directory first
+	cs1550_root_directory* now = block_alloc(sizeof(cs1550_root_directory));
+	pthread_mutex_lock(&root_lock);
+	disk_read(0,now,sizeof(cs1550_root_directory));
+	int k;
+	for(k=0;k<now->nDirectories;k++){
+		if(strcmp(now->directories[k].dname,root->directories[i].dname)==0){
+			break;
+		}
+	}
+	bool won = k<now->nDirectories && now->directories[k].nStartBlock==old;
+	long current = k<now->nDirectories ? now->directories[k].nStartBlock : old;
+	if(won){
+		now->directories[k].nStartBlock = block;
+		disk_write(0,now,sizeof(cs1550_root_directory));
+	}
+	pthread_mutex_unlock(&root_lock);
+	free(now);
+	if(won){
+		release_dir(old);	//the snapshot still holds it, unless it was deleted meanwhile
+		root->directories[i].nStartBlock = block;
+	}else{	//lost, carry on in the other copy
+		for(j=0;j<dir->nFiles;j++){
+			ref_drop(dir->files[j].nIndexBlock);
+		}
+		bitmap_release(&block,1);
+		tables_flush();
+		root->directories[i].nStartBlock = current;
+		disk_read(512*current,dir,sizeof(cs1550_directory_entry));
+	}
+	return 0;
+}
+
+//makes file j of directory i, whose index block is in idx, safe to change
+static int file_unshare(cs1550_root_directory* root,int i,cs1550_directory_entry* dir,int j,
+			const cs1550_index_block* idx){
+	int res = dir_unshare(root,i,dir);
+	long old = dir->files[j].nIndexBlock;
+	if(res<0 || ref_count(old)==0){
+		return res;
+	}
+	long block = bitmap_find();
+	if(block<0){
+		return -ENOSPC;
+	}
+	int k;
+	for(k=0;k<(int)MAX_ENTRIES_IN_INDEX_BLOCK;k++){
+		long data = ENTRY_BLOCK(idx->entries[k]);
+		if(data!=NO_BLOCK && !ref_take(data)){
+			while(k-->0){
+				data = ENTRY_BLOCK(idx->entries[k]);
+				if(data!=NO_BLOCK){
+					ref_drop(data);
+				}
+			}
+			bitmap_release(&block,1);
+			return -EMLINK;
+		}
+	}
+	tables_flush();
+	disk_write(512*block,idx,sizeof(cs1550_index_block));
+	dir->files[j].nIndexBlock = block;
+	disk_write(512*root->directories[i].nStartBlock,dir,sizeof(cs1550_directory_entry));
+	release_index(old);	//as for the directory, a snapshot may have let go of it meanwhile
+	return 0;
+}
+
+/*
+ * Makes to a clone of the file from. Only a reference to the index block is
+ * taken, the two part ways block by block as either is written.
+ */
+static int cs1550_clone(const char* from,const char* to)
+{
+	char dir_name[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+	memset(ext,0,sizeof(ext));
+	int valid_name = sscanf(to, "/%8[^/]/%8[^.].%3s", dir_name, filename, ext);
+	if(valid_name<2){
+		return -EINVAL;
+	}
+	//anything the widths above cut off was too long
+	if(strlen(to)!=2+strlen(dir_name)+strlen(filename)+(valid_name==3 ? 1+strlen(ext) : 0)){
+		return -ENAMETOOLONG;
+	}
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dir = block_alloc(sizeof(cs1550_directory_entry));
+	struct cs1550_file_directory source;
+	int i;
+	int j;
+	//the source has to stay put too, both locks are taken in array order
+	pthread_mutex_t* from_lock = dir_lock_of(from);
+	pthread_mutex_t* to_lock = dir_lock_of(to);
+	pthread_mutex_lock(from_lock<to_lock ? from_lock : to_lock);
+	if(from_lock!=to_lock){
+		pthread_mutex_lock(from_lock<to_lock ? to_lock : from_lock);
+	}
+	int res = find_file(from,root,dir,&i,&j);
+	if(res==0){
+		source = dir->files[j];
+		res = refs_ensure();
+	}
+	if(res==0){
+		for(i=0;i<root->nDirectories;i++){
+			if(strcmp(root->directories[i].dname,dir_name)==0){
+				break;
+			}
+		}
+		if(i==root->nDirectories){
+			res = -ENOENT;
+		}
+	}
+	if(res==0){
+		disk_read(512*root->directories[i].nStartBlock,dir,sizeof(cs1550_directory_entry));
+		for(j=0;j<dir->nFiles && res==0;j++){
+			if(strcmp(dir->files[j].fname,filename)==0 && strcmp(dir->files[j].fext,ext)==0){
+				res = -EEXIST;
+			}
+		}
+		if(res==0 && dir->nFiles==MAX_FILES_IN_DIR){
+			res = -ENOSPC;
+		}
+	}
+	if(res==0){
+		res = dir_unshare(root,i,dir);
+	}
+	if(res==0 && !ref_take(source.nIndexBlock)){
+		res = -EMLINK;
+	}
+	if(res==0){
+		struct cs1550_file_directory* clone = &dir->files[dir->nFiles];
+		memset(clone,0,sizeof(struct cs1550_file_directory));
+		snprintf(clone->fname,sizeof(clone->fname),"%s",filename);
+		snprintf(clone->fext,sizeof(clone->fext),"%s",ext);
+		clone->fsize = source.fsize;
+		clone->nIndexBlock = source.nIndexBlock;
+		dir->nFiles++;
+		usage_count(&superblock.nFiles,1);
+		tables_flush();
+		disk_write(512*root->directories[i].nStartBlock,dir,sizeof(cs1550_directory_entry));
+	}
+	pthread_mutex_unlock(to_lock);
+	if(from_lock!=to_lock){
+		pthread_mutex_unlock(from_lock);
+	}
+	free(root);
+	free(dir);
+	return res;
+}
+
+//reads the list of snapshots, false if there isn't one yet
+static bool snapshots_read(cs1550_root_directory* list){
+	if(superblock.nSnapshotBlock==NO_BLOCK){
+		memset(list,0,sizeof(cs1550_root_directory));
+		return false;
+	}
+	disk_read(512*superblock.nSnapshotBlock,list,sizeof(cs1550_root_directory));
+	return true;
+}
+
+static int snapshot_find(const cs1550_root_directory* list,const char* name){
+	int k;
+	for(k=0;k<list->nDirectories;k++){
+		if(strcmp(list->directories[k].dname,name)==0){
+			return k;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Freezes the volume as it is now under name: a copy of the root that
+ * shares every directory block with the live one.
+ */
+static int cs1550_snapshot(const char* name)
+{
+	if(strlen(name)==0 || strlen(name)>MAX_FILENAME || strchr(name,'/')!=NULL){
+		return -EINVAL;
+	}
+	int res = refs_ensure();
+	if(res<0){
+		return res;
+	}
+	cs1550_root_directory* list = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	int k;
+	for(k=0;k<DIR_LOCKS;k++){	//no directory is halfway through a change
+		pthread_mutex_lock(&dir_locks[k]);
+	}
+	pthread_mutex_lock(&root_lock);	//the list and the root both
+	if(!snapshots_read(list)){
+		long block = bitmap_find();
+		if(block<0){
+			res = -ENOSPC;
+		}else{
+			disk_write(512*block,list,sizeof(cs1550_root_directory));
+			superblock_set(&superblock.nSnapshotBlock,block);
+		}
+	}
+	if(res==0 && snapshot_find(list,name)>=0){
+		res = -EEXIST;
+	}
+	if(res==0 && list->nDirectories==MAX_DIRS_IN_ROOT){
+		res = -ENOSPC;
+	}
+	long block = -1;
+	if(res==0){
+		block = bitmap_find();
+		if(block<0){
+			res = -ENOSPC;
+		}
+	}
+	int i;
+	if(res==0){
+		disk_read(0,root,sizeof(cs1550_root_directory));
+		for(i=0;i<root->nDirectories;i++){
+			if(!ref_take(root->directories[i].nStartBlock)){
+				while(i-->0){
+					ref_drop(root->directories[i].nStartBlock);
+				}
+				bitmap_release(&block,1);
+				res = -EMLINK;
+				break;
+			}
+		}
+	}
+	if(res==0){
+		tables_flush();
+		disk_write(512*block,root,sizeof(cs1550_root_directory));
+		memset(&list->directories[list->nDirectories],0,sizeof(struct cs1550_directory));
+		snprintf(list->directories[list->nDirectories].dname,MAX_FILENAME+1,"%.*s",MAX_FILENAME,name);
+		list->directories[list->nDirectories].nStartBlock = block;
+		list->nDirectories++;
+		disk_write(512*superblock.nSnapshotBlock,list,sizeof(cs1550_root_directory));
+	}
+	pthread_mutex_unlock(&root_lock);
+	for(k=0;k<DIR_LOCKS;k++){
+		pthread_mutex_unlock(&dir_locks[k]);
+	}
+	free(root);
+	free(list);
+	return res;
+}
+
+//looks at the snapshot called name instead of the live volume, read only
+static int snapshot_open(const char* name)
+{
+	cs1550_root_directory* list = block_alloc(sizeof(cs1550_root_directory));
+	int k = -1;
+	if(snapshots_read(list)){
+		k = snapshot_find(list,name);
+	}
+	if(k>=0){
+		root_block = list->directories[k].nStartBlock;
+		read_only = true;
+	}
+	free(list);
+	return k<0 ? -ENOENT : 0;
+}
+
+//drops a snapshot, blocks only it still held are freed
+static int cs1550_snapshot_delete(const char* name)
+{
+	cs1550_root_directory* list = block_alloc(sizeof(cs1550_root_directory));
+	int k = -1;
+	pthread_mutex_lock(&root_lock);
+	if(snapshots_read(list)){
+		k = snapshot_find(list,name);
+	}
+	if(k<0){
+		pthread_mutex_unlock(&root_lock);
+		free(list);
+		return -ENOENT;
+	}
+	long block = list->directories[k].nStartBlock;
+	memmove(&list->directories[k],&list->directories[k+1],
+			(list->nDirectories-k-1)*sizeof(struct cs1550_directory));
+	list->nDirectories--;
+	disk_write(512*superblock.nSnapshotBlock,list,sizeof(cs1550_root_directory));
+	pthread_mutex_unlock(&root_lock);
+
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	disk_read(512*block,root,sizeof(cs1550_root_directory));
+	int i;
+	for(i=0;i<root->nDirectories;i++){
+		release_dir(root->directories[i].nStartBlock);
+	}
+	reclaim_block(block);
+	tables_flush();
+	free(root);
+	free(list);
+	return 0;
+}
+
+//reads the plaintext of cluster c into buf, len is how much of the cluster
+//lies inside the file. Everything past the data reads as zeros.
+static int cluster_load(long index_block,const cs1550_index_block* idx,int c,int len,char* buf){
+	const long* e = &idx->entries[c*CLUSTER_BLOCKS];
+	int clen = ENTRY_CLEN(e[0]);
+	struct disk_extent ext[CLUSTER_BLOCKS];
+	int n = 0;
+	int b;
+	memset(buf,0,CLUSTER_SIZE);
+	if(clen==0){	//stored as is
+		for(b=0;b<CLUSTER_BLOCKS && b*BLOCK_SIZE<len;b++){
+			if(ENTRY_HAS_DATA(e[b])){
+				extent_add(ext,&n,ENTRY_BLOCK(e[b])*512,buf+b*BLOCK_SIZE,BLOCK_SIZE);
+			}
+		}
+		return disk_rw(false,ext,n);
+	}
+	if(cache_get(index_block,c,buf)){
+		return 0;
+	}
+	unsigned char packed[CLUSTER_SIZE] __attribute__((aligned(BUFFER_ALIGN)));
+	for(b=0;b*BLOCK_SIZE<clen;b++){
+		extent_add(ext,&n,ENTRY_BLOCK(e[b])*512,(char*)packed+b*BLOCK_SIZE,BLOCK_SIZE);
+	}
+	if(disk_rw(false,ext,n)<0){
+		memset(buf,0,CLUSTER_SIZE);
+		return -EIO;
+	}
+	if(lz_decompress(packed,clen,(unsigned char*)buf,CLUSTER_SIZE)<0){
+		memset(buf,0,CLUSTER_SIZE);
+		return -EIO;
+	}
+	cache_put(index_block,c,buf);
+	return 0;
+}
+
+//writes the first len bytes of buf as cluster c, compressed if compression
+//mode is on and it saves at least one block. Blocks the cluster no longer
+//needs are dropped.
+static int cluster_store(long index_block,cs1550_index_block* idx,int c,const char* buf,int len){
+	long* e = &idx->entries[c*CLUSTER_BLOCKS];
+	unsigned char packed[CLUSTER_SIZE] __attribute__((aligned(BUFFER_ALIGN)));
+	const char* src = buf;
+	int nblocks = (len+BLOCK_SIZE-1)/BLOCK_SIZE;
+	int full = len/BLOCK_SIZE;
+	int clen = 0;
+	int b;
+	if(options.compress && nblocks>1){
+		memset(packed,0,sizeof(packed));
+		clen = lz_compress((const unsigned char*)buf,len,packed,(nblocks-1)*BLOCK_SIZE);
+		if(clen>0){
+			nblocks = (clen+BLOCK_SIZE-1)/BLOCK_SIZE;
+			full = nblocks;	//rewritten whole every time, so the padded tail can be shared too
+			src = (const char*)packed;
+		}else{
+			clen = 0;
+		}
+	}
+	struct block_batch batch;
+	memset(&batch,0,sizeof(batch));
+	int res = put_blocks(&batch,e,src,nblocks,full);
+	if(res==0){
+		for(b=nblocks;b<CLUSTER_BLOCKS;b++){
+			batch_drop(&batch,ENTRY_BLOCK(e[b]));
+			e[b] = NO_BLOCK;
+		}
+		e[0] = MAKE_ENTRY(ENTRY_BLOCK(e[0]),clen);
+	}
+	batch_finish(&batch);
+	if(res==0 && clen>0){
+		cache_put(index_block,c,buf);
+	}else{
+		cache_drop(index_block,c);
+	}
+	return res;
+}
+
+//writes bytes [lo,hi) of the file, which lie in uncompressed clusters, a
+//block at a time. old_size and new_size are the file size before and after.
+//It all goes out in one put_blocks, so it is spread over the backing files.
+static int blocks_write_raw(cs1550_index_block* idx,long lo,long hi,const char* src,long old_size,long new_size){
+	long* e = idx->entries;
+	int first = lo/BLOCK_SIZE;
+	int last = (hi-1)/BLOCK_SIZE;
+	int count = last-first+1;
+	int full = new_size/BLOCK_SIZE-first;
+	int b;
+	if(full>count){
+		full = count;
+	}
+	struct block_batch batch;
+	memset(&batch,0,sizeof(batch));
+	char* data = block_alloc(count*BLOCK_SIZE);
+	memset(data,0,count*BLOCK_SIZE);
+	struct disk_extent ext[2];	//only the two ends can be partial
+	int n = 0;
+	for(b=first;b<=last;b++){
+		long start = (long)b*BLOCK_SIZE;
+		char* block_data = data+(b-first)*BLOCK_SIZE;
+		bool partial = lo>start || hi<start+BLOCK_SIZE;
+		if(partial && ENTRY_HAS_DATA(e[b]) && start<old_size){	//keep the bytes we aren't overwriting
+			extent_add(ext,&n,ENTRY_BLOCK(e[b])*512,block_data,BLOCK_SIZE);
+		}
+	}
+	disk_rw(false,ext,n);
+	memcpy(data+(lo-(long)first*BLOCK_SIZE),src,hi-lo);
+	int res = put_blocks(&batch,e+first,data,count,full);
+	batch_finish(&batch);
+	free(data);
+	return res;
+}
+
+static int cs1550_getattr(const char *path, struct stat *stbuf)
+{
+	char dir_name[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1]; 
+	int valid_name = sscanf(path, "/%[^/]/%[^.].%s", dir_name, filename, ext); 
+	//check the filename length
+	int res = 0;
+	memset(stbuf, 0, sizeof(struct stat));
+	//is path the root dir?
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	}else if(valid_name==1){  //Check if name is subdirectory
+		//start from the root check the subdirectories
+		bool directory_found =false;
+		cs1550_root_directory* root_dir = block_alloc(sizeof(cs1550_root_directory));
+		disk_read(512*root_block,root_dir,sizeof(cs1550_root_directory));
+		int i;
+		//printf("debugging 1:!\n");
+		for(i =0;i<root_dir->nDirectories;i++){
+			if(strcmp(dir_name,root_dir->directories[i].dname) == 0){
+				directory_found=true;
+				break;
+			}
+		}
+		if(directory_found){
+			//Might want to return a structure with these fields
+			stbuf->st_mode = S_IFDIR | 0755;
+			stbuf->st_nlink = 2;
+			res = 0; //no error
+		}
+		else{//use your god damn brakets okay?
+			res=-ENOENT;
+		}
+		free(root_dir);
+	}
+	//Check if name is a regular file
+	else if(valid_name==3){
+		bool file_found =false;
+		cs1550_root_directory* root_dir1 = block_alloc(sizeof(cs1550_root_directory));
+		disk_read(512*root_block,root_dir1,sizeof(cs1550_root_directory));
+		cs1550_directory_entry* sub_directory = block_alloc(sizeof(cs1550_directory_entry));
+		int i,j;
+		for(i =0;i<root_dir1->nDirectories;i++){
+			if(strcmp(dir_name,root_dir1->directories[i].dname)!=0){
+				continue;	//only look in the directory the path names
+			}
+			disk_read(512*root_dir1->directories[i].nStartBlock,sub_directory,sizeof(cs1550_directory_entry));
+			for(j =0;j<sub_directory->nFiles;j++){
+				if(strcmp(filename,sub_directory->files[j].fname)==0 && strcmp(ext,sub_directory->files[j].fext)==0){
+					file_found = true;
+					break;
+				}
+			}
+			if(file_found)
+				break;
+		}
+		if(file_found){
+			//regular file, probably want to be read and write
+			stbuf->st_mode = S_IFREG | 0666;
+			stbuf->st_nlink = 1; //file links
+			stbuf->st_size = sub_directory->files[j].fsize; //file size - make sure you replace with real size!
+			res = 0; // no error
+		}
+		else{
+			//Else return that file doesn't exist
+			res = -ENOENT;
+		}
+	free(root_dir1);
+	free(sub_directory);
+	}
+	else{
+		res = -ENOENT;
+	}
+	return res;
+	
+}
+
+/*
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ */
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	char dir_name[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1]; 
+	int valid_name = sscanf(path, "/%[^/]/%[^.].%s", dir_name, filename, ext); 
+	//check the filename length
+	if(valid_name>1){
+		return -ENOENT; 
+	}
+	//but if it's the root...
+	bool is_root = (strcmp(path,"/") == 0);
+	bool directory_found =false;
+	int dir_index = -1;
+	cs1550_root_directory* root_dir = block_alloc(sizeof(cs1550_root_directory)); //root
+	disk_read(512*root_block,root_dir,sizeof(cs1550_root_directory));
+	if(is_root && root_dir->nDirectories==0 ){//if the root is empty
+		filler(buf, ".", NULL, 0);
+		filler(buf, "..", NULL, 0);
+		free(root_dir);
+		return 0;
+	}
+	int i,k;
+	
+	for(i =0;i<root_dir->nDirectories;i++){
+		if(is_root){
+			filler(buf,root_dir->directories[i].dname, NULL, 0);
+			continue;
+		}
+		
+		if(strcmp(dir_name,root_dir->directories[i].dname)==0){	//try to find where the directory is located in disk
+			directory_found=true;
+			dir_index = root_dir->directories[i].nStartBlock;
+			break;
+		}
+	}
+	if(is_root){
+		filler(buf, ".", NULL, 0);
+		filler(buf, "..", NULL, 0);
+		free(root_dir);
+		return 0;
+	}
+	if(!directory_found){
+		free(root_dir);
+		return -ENOENT;
+	}
+	//if we found the directory on disk, loop through it
+	cs1550_directory_entry* sub_directory = block_alloc(sizeof(cs1550_directory_entry));
+	disk_read(dir_index*512,sub_directory,sizeof(cs1550_directory_entry));
+
+	char f_names[9];
+	char f_ext[4];
+	memset(f_names,'\0',sizeof(f_names));
+	memset(f_ext,'\0',sizeof(f_ext));
+	for(k=0;k<sub_directory->nFiles;k++){	//add all to the listing
+		strncpy(f_names,sub_directory->files[k].fname,sizeof(f_names)-1);
+		strncpy(f_ext,sub_directory->files[k].fext,sizeof(f_ext)-1);
+		char* fn1 = strcat(f_names,".");
+		char* fn2 = strcat(fn1,f_ext); 
+		filler(buf,fn2,NULL, 0);
+	}
+
+	//Since we're building with -Wall (all warnings reported) we need
+	//to "use" every parameter, so let's just cast them to void to
+	//satisfy the compiler
+	(void) offset;
+	(void) fi;
+	//This line assumes we have no subdirectories, need to change
+	//if (strcmp(path, "/") != 0)
+	//return -ENOENT;
+	//the filler function allows us to add entries to the listing
+	//read the fuse.h file for a description (in the ../include dir)
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	/*
+	//add the user stuff (subdirs or files)
+	//the +1 skips the leading '/' on the filenames
+	filler(buf, newpath + 1, NULL, 0);
+	*/
+	free(root_dir);
+	free(sub_directory);
+	return 0;
+}
+
+/*
+ * Creates a directory. We can ignore mode since we're not dealing with
+ * permissions, as long as getattr returns appropriate ones for us.
+ */
+static int cs1550_mkdir(const char *path, mode_t mode)
+{
+	if(read_only){	//a snapshot
+		return -EROFS;
+	}
+	char dir_name[MAX_FILENAME +1];
+	char filename[MAX_FILENAME +1];
+	char ext[MAX_EXTENSION +1]; 
+	int valid_name = sscanf(path, "/%[^/]/%[^.].%s", dir_name, filename, ext); 
+	//check the filename length
+	//check if it's only under the root 
+	if(valid_name >1)
+	return -EPERM;
+	//check length
+	if(strlen(dir_name)>8){
+		return -ENAMETOOLONG;
+	}
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	pthread_mutex_lock(&root_lock);
+	//start from the root check the subdirectories
+	disk_read(0,root,sizeof(cs1550_root_directory));
+	if(root->nDirectories == 29){
+		pthread_mutex_unlock(&root_lock);
+		free(root);
+		return -ENOSPC;
+	}
+	int i;
+	for(i =0;i<root->nDirectories;i++){
+		if(strcmp(dir_name,root->directories[i].dname) == 0){
+			pthread_mutex_unlock(&root_lock);
+			free(root);
+			return -EEXIST;
+		}
+	}
+	//search the bitmap to find the block
+	int h = bitmap_find();
+	if(h<0){
+		pthread_mutex_unlock(&root_lock);
+		free(root);
+		return -ENOSPC;
+	}
+	//add the new dir to root
+	root->nDirectories++;
+	usage_count(&superblock.nDirectories,1);
+	int sizeof_name = sizeof(root->directories[root->nDirectories-1].dname);
+	strncpy(root->directories[root->nDirectories-1].dname,dir_name,sizeof_name);
+	root->directories[root->nDirectories-1].nStartBlock=h;
+	disk_write(0,root,sizeof(cs1550_root_directory)); //update the disk root
+	//make a new entey
+	cs1550_directory_entry* new_dir = block_alloc(sizeof(cs1550_directory_entry));
+	new_dir->nFiles=0;
+	disk_write(h*512,new_dir,sizeof(cs1550_directory_entry)); //write the new entry to the disk
+	pthread_mutex_unlock(&root_lock);
+	(void) path;
+	(void) mode;
+	free(root);
+	free(new_dir);
+	return 0;
 }
 
 /*
@@ -370,8 +2500,56 @@ static int cs1550_mkdir(const char *path, mode_t mode)
  */
 static int cs1550_rmdir(const char *path)
 {
-	(void) path;
-    return 0;
+	if(read_only){	//a snapshot
+		return -EROFS;
+	}
+	char dir_name[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+	int valid_name = sscanf(path, "/%[^/]/%[^.].%s", dir_name, filename, ext);
+	if(valid_name>1){
+		return -ENOTDIR;
+	}
+	if(valid_name<1){	//the root itself
+		return -EBUSY;
+	}
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dir = block_alloc(sizeof(cs1550_directory_entry));
+	pthread_mutex_t* dir_lock = dir_lock_of(path);	//nothing may go in while it is checked
+	pthread_mutex_lock(dir_lock);
+	pthread_mutex_lock(&root_lock);
+	disk_read(0,root,sizeof(cs1550_root_directory));
+	int i;
+	for(i=0;i<root->nDirectories;i++){
+		if(strcmp(dir_name,root->directories[i].dname) == 0){
+			break;
+		}
+	}
+	int res = 0;
+	if(i==root->nDirectories){
+		res = -ENOENT;
+	}else{
+		disk_read(512*root->directories[i].nStartBlock,dir,sizeof(cs1550_directory_entry));
+		if(dir->nFiles>0){
+			res = -ENOTEMPTY;
+		}
+	}
+	if(res==0){
+		long block = root->directories[i].nStartBlock;
+		//close the gap in the root so it stays packed
+		memmove(&root->directories[i],&root->directories[i+1],
+				(root->nDirectories-i-1)*sizeof(struct cs1550_directory));
+		root->nDirectories--;
+		usage_count(&superblock.nDirectories,-1);
+		disk_write(0,root,sizeof(cs1550_root_directory));
+		reclaim_block(block);
+	}
+	pthread_mutex_unlock(&root_lock);
+	pthread_mutex_unlock(dir_lock);
+	tables_flush();	//a snapshot may still have held the directory block
+	free(root);
+	free(dir);
+	return res;
 }
 
 /*
@@ -380,6 +2558,9 @@ static int cs1550_rmdir(const char *path)
  */
 static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 {
+	if(read_only){	//a snapshot
+		return -EROFS;
+	}
 	unsigned long int file_name_length = MAX_FILENAME +1;
 	unsigned long int file_ext_length = MAX_EXTENSION +1;
 	char dir_name[file_name_length];
@@ -397,24 +2578,29 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 	if(valid_name == 1){
 		return -EPERM;
 	}
-	FILE* fp =fopen(".disk","rb+");
-	cs1550_root_directory* root = malloc(sizeof(cs1550_root_directory));
-	cs1550_directory_entry* dir = malloc(sizeof(cs1550_directory_entry));
-	fread(root,sizeof(cs1550_root_directory),1,fp);
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dir = block_alloc(sizeof(cs1550_directory_entry));
+	pthread_mutex_t* dir_lock = dir_lock_of(path);
+	pthread_mutex_lock(dir_lock);
+	disk_read(0,root,sizeof(cs1550_root_directory));
 	int i;
 	int j;
 	for(i =0;i<root->nDirectories;i++){
 		if(strcmp(dir_name,root->directories[i].dname) == 0){
-			fseek(fp,512*root->directories[i].nStartBlock,SEEK_SET);
-			fread(dir,sizeof(cs1550_directory_entry),1,fp);
+			disk_read(512*root->directories[i].nStartBlock,dir,sizeof(cs1550_directory_entry));
 			break;
 		}
 	}
-	if(i == root->nDirectories)
+	if(i == root->nDirectories){
+		pthread_mutex_unlock(dir_lock);
+		free(root);
+		free(dir);
 		return -ENOENT;
+	}
 	//file already exist
 	for(j=0;j<dir->nFiles;j++){
 		if(strcmp(filename,dir->files[j].fname)==0 && strcmp(ext,dir->files[j].fext) ==0){
+			pthread_mutex_unlock(dir_lock);
 			free(root);
 			free(dir);
 			return -EEXIST;
@@ -422,38 +2608,32 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 		}
 	 //IF THE FILE DOESN'T EXIST AND EVERYTHING IS FINE
 	if(dir->nFiles==MAX_FILES_IN_DIR){
+		pthread_mutex_unlock(dir_lock);
 		free(root);
 		free(dir);
 		return -ENOSPC;
 	}
+	int res = dir_unshare(root,i,dir);
+	if(res<0){
+		pthread_mutex_unlock(dir_lock);
+		free(root);
+		free(dir);
+		return res;
+	}
 
-	char bitmap[1280];
 	//search the bitmap to find the block
-	fseek(fp,-3*512,SEEK_END);
-	fread(bitmap,1280,1,fp);
-	int h;
-	int index_block =-1;//index block for the file
-	int start_index =-1;//first entry in the index block
-	for(h=0;h<10240;h++){
-		if(checkBit(bitmap[h/8],h%8)){
-			bitmap[h/8]=setBit(bitmap[h/8],h%8);
-			if(index_block==-1){
-				index_block = h;
-			}else if(start_index ==-1){
-				start_index =h;
-				break;
-			}
-		}
+	int index_block = bitmap_find();//index block for the file
+	if(index_block<0){
+		pthread_mutex_unlock(dir_lock);
+		free(root);
+		free(dir);
+		return -ENOSPC;
 	}
-	//update the bitmap
-	fseek(fp,-3*512,SEEK_END);
-	fwrite(bitmap,1280,1,fp);
-
-	//make an index block and write to disk
-	cs1550_index_block* i_block = malloc(sizeof(cs1550_index_block));
-	i_block->entries[0] = start_index;
-	fseek(fp,512*index_block,SEEK_SET);
-	fwrite(i_block,sizeof(cs1550_index_block),1,fp);//write the index block at :index_block 
+
+	//make an index block and write to disk, data blocks come with the first write
+	cs1550_index_block* i_block = block_alloc(sizeof(cs1550_index_block));
+	memset(i_block,0,sizeof(cs1550_index_block));	//all holes
+	disk_write(512*index_block,i_block,sizeof(cs1550_index_block));//write the index block at :index_block 
 	//update the directory information
 	
 	int sizeof_name = sizeof(dir->files[dir->nFiles].fname);
@@ -463,8 +2643,9 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 	dir->files[dir->nFiles].fsize = 0;	//set file size to 0
 	dir->files[dir->nFiles].nIndexBlock = index_block; //set the index block to :index_block	
 	dir->nFiles++;//increment the count of files in the directory
-	fseek(fp,512*root->directories[i].nStartBlock,SEEK_SET);
-	fwrite(dir,sizeof(cs1550_directory_entry),1,fp);		//write the updated directory to disk
+	usage_count(&superblock.nFiles,1);
+	disk_write(512*root->directories[i].nStartBlock,dir,sizeof(cs1550_directory_entry));		//write the updated directory to disk
+	pthread_mutex_unlock(dir_lock);
 	//success
 	(void) mode;
 	(void) dev;
@@ -472,7 +2653,6 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 	free(i_block);
 	free(root);
 	free(dir);
-	fclose(fp);
 	return 0;
 }
 
@@ -481,9 +2661,37 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
  */
 static int cs1550_unlink(const char *path)
 {
-    (void) path;
-
-    return 0;
+	if(read_only){	//a snapshot
+		return -EROFS;
+	}
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dirt = block_alloc(sizeof(cs1550_directory_entry));
+	int i;
+	int j;
+	pthread_mutex_t* dir_lock = dir_lock_of(path);
+	pthread_mutex_lock(dir_lock);
+	int res = find_file(path,root,dirt,&i,&j);
+	if(res==0){
+		res = dir_unshare(root,i,dirt);
+	}
+	if(res<0){
+		pthread_mutex_unlock(dir_lock);
+		free(root);
+		free(dirt);
+		return res;
+	}
+	long index_block = dirt->files[j].nIndexBlock;
+	//take the file out of its directory first, the blocks can wait
+	memmove(&dirt->files[j],&dirt->files[j+1],
+			(dirt->nFiles-j-1)*sizeof(struct cs1550_file_directory));
+	dirt->nFiles--;
+	usage_count(&superblock.nFiles,-1);
+	disk_write(512*root->directories[i].nStartBlock,dirt,sizeof(cs1550_directory_entry));
+	pthread_mutex_unlock(dir_lock);
+	release_index(index_block);
+	free(root);
+	free(dirt);
+	return 0;
 }
 
 /*
@@ -493,110 +2701,80 @@ static int cs1550_unlink(const char *path)
 static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 			  struct fuse_file_info *fi)
 {
-	(void) buf;
-	(void) offset;
 	(void) fi;
-	(void) path;
-	char dir_name[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
-	char ext[MAX_EXTENSION + 1]; 
-	int valid_name = sscanf(path, "/%[^/]/%[^.].%s", dir_name, filename, ext);
-	if(valid_name==1){
-		return -EISDIR;
-	}
-	FILE *fp = fopen(".disk","rb+");
-	cs1550_root_directory* root = malloc(sizeof(cs1550_root_directory));
-	cs1550_directory_entry* dirt = malloc(sizeof(cs1550_directory_entry));
-	fread(root,sizeof(cs1550_root_directory),1,fp);
-	int i;
 	//check that size is > 0
 	if(size<=0){		//size less than 0
-		free(root);
-		free(dirt);
 		return -ENOENT;
 	}
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dirt = block_alloc(sizeof(cs1550_directory_entry));
+	int i;
+	int j;
 	//check to make sure path exists
-	for(i=0;i<root->nDirectories;i++){
-		if(strcmp(root->directories[i].dname,dir_name)==0){
-			fseek(fp,512*root->directories[i].nStartBlock,SEEK_SET);
-			fread(dirt,sizeof(cs1550_directory_entry),1,fp);
-			break;
-		}
-	}
-	if(i==root->nDirectories){	//path doesn't exist
+	int res = find_file(path,root,dirt,&i,&j);
+	if(res<0){
 		free(root);
 		free(dirt);
-		return -ENOENT;
-	}
-	int j;
-	int file_size = 0;
-	for(j=0;j<dirt->nFiles;j++){//j will be the index for the file in dirt
-		if(strcmp(dirt->files[j].fname,filename)==0 && strcmp(dirt->files[j].fname,filename)==0){
-			file_size=dirt->files[j].fsize;
-			if(offset>dirt->files[j].fsize){ //offset too big//check that offset is <= to the file size
-				free(root);
-				free(dirt);
-				return -EFBIG;		
-			}
-			break;
-		} 
+		return res;
 	}
-	if(j==dirt->nFiles){// path doesn't exist
+	long file_size = dirt->files[j].fsize;
+	if(offset>=file_size){	//nothing left to read
 		free(root);
 		free(dirt);
-		return -ENOENT;
+		return 0;
 	}
+	long end = offset+size<(size_t)file_size ? offset+(long)size : file_size;
+	long index_block = dirt->files[j].nIndexBlock;
+	cs1550_index_block* index_blk = block_alloc(sizeof(cs1550_index_block));
+	disk_read(512*index_block,index_blk,sizeof(cs1550_index_block));
 
-	cs1550_index_block* index_blk = malloc(sizeof(cs1550_index_block));
-	fseek(fp,512*dirt->files[j].nIndexBlock,SEEK_SET);
-	fread(index_blk,sizeof(cs1550_index_block),1,fp);
-	
-	//find out how many blocks do we need...
-	int count = file_size/512+1;	//how many blocks are used by the file
-	int start_block = 0;	//where the write should start
-	int start_from = 0;		//which byte in the block to start from
-	if(offset<file_size){	
-		start_block = offset/512;
-		start_from = offset%512;
-	}
-	else 	
-	{	
-		start_block = file_size/512;
-		start_from = file_size%512;	
-	}
-	cs1550_disk_block* data_block = malloc(sizeof(cs1550_disk_block));
-	char data_buf[file_size];
-	memset(data_buf,'\0',sizeof(data_buf));
-	int total_to_read = file_size-offset;
-	int a;
-	for(a=start_block;a<count;a++){
-		fseek(fp,index_blk->entries[a]*512,SEEK_SET);
-		if (a==start_block){
-			fseek(fp,start_from,SEEK_CUR);
-		}
-		if(total_to_read<=512){
-			fread(data_block->data,total_to_read,1,fp);
-			strncat(data_buf,data_block->data,total_to_read);
-		}else{
-			fread(data_block->data,512,1,fp);
-			strncat(data_buf,data_block->data,512);
-			free(data_block);
-			data_block = malloc(sizeof(cs1550_disk_block));
-			total_to_read -=512;
+	char* cluster = block_alloc(CLUSTER_SIZE);
+	//the uncompressed blocks are all read at once at the end, spread over
+	//the backing files
+	struct disk_extent* ext = malloc(MAX_ENTRIES_IN_INDEX_BLOCK*sizeof(struct disk_extent));
+	int n_ext = 0;
+	long pos = offset;
+	while(pos<end){
+		int c = pos/CLUSTER_SIZE;
+		long cluster_start = (long)c*CLUSTER_SIZE;
+		int from = pos-cluster_start;
+		int to = end<cluster_start+CLUSTER_SIZE ? end-cluster_start : CLUSTER_SIZE;
+		if(ENTRY_CLEN(index_blk->entries[c*CLUSTER_BLOCKS])>0){
+			int len = file_size<cluster_start+CLUSTER_SIZE ? file_size-cluster_start : CLUSTER_SIZE;
+			res = cluster_load(index_block,index_blk,c,len,cluster);
+			if(res<0){
+				break;
+			}
+			memcpy(buf+(pos-offset),cluster+from,to-from);
+		}else{	//uncompressed, read straight into buf
+			while(from<to){
+				long entry = index_blk->entries[c*CLUSTER_BLOCKS+from/BLOCK_SIZE];
+				long block = ENTRY_BLOCK(entry);
+				int in_block = from%BLOCK_SIZE;
+				int n = BLOCK_SIZE-in_block<to-from ? BLOCK_SIZE-in_block : to-from;
+				if(!ENTRY_HAS_DATA(entry)){	//a hole
+					memset(buf+(cluster_start+from-offset),0,n);
+				}else{
+					extent_add(ext,&n_ext,block*512+in_block,buf+(cluster_start+from-offset),n);
+				}
+				from += n;
+			}
 		}
-
-	
+		pos = cluster_start+to;
 	}
-	//read in data
-	//set size and return, or error
-	strncpy(buf,data_buf,file_size-offset);
-	//free(data_buf);
+	if(res==0){
+		res = disk_rw(false,ext,n_ext);
+	}
+	free(ext);
+	free(cluster);
 	free(root);
 	free(dirt);
 	free(index_blk);
-	free(data_block);
-	fclose(fp);
-	return size;
+	//set size and return, or error
+	if(res<0){
+		return res;
+	}
+	return end-offset;
 }
 
 /*
@@ -606,155 +2784,347 @@ static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 static int cs1550_write(const char *path, const char *buf, size_t size,
 			  off_t offset, struct fuse_file_info *fi)
 {
-	char dir_name[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
-	char ext[MAX_EXTENSION + 1]; 
-	sscanf(path, "/%[^/]/%[^.].%s", dir_name, filename, ext); 
-	//check the filename length
-	
-	(void) buf;
-	(void) offset;
 	(void) fi;
-	(void) path;
-	FILE *fp = fopen(".disk","rb+");
-	cs1550_root_directory* root = malloc(sizeof(cs1550_root_directory));
-	cs1550_directory_entry* dirt = malloc(sizeof(cs1550_directory_entry));
-	fread(root,sizeof(cs1550_root_directory),1,fp);
-	int i;
 	if(size<=0){		//size less than 0
+		return -ENOENT;
+	}
+	if(read_only){	//a snapshot
+		return -EROFS;
+	}
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dirt = block_alloc(sizeof(cs1550_directory_entry));
+	int i;
+	int j;
+	pthread_mutex_t* dir_lock = dir_lock_of(path);	//the size goes back into the directory at the end
+	pthread_mutex_lock(dir_lock);
+	//writing past the end is fine, the gap is left as a hole
+	int res = find_file(path,root,dirt,&i,&j);
+	if(res==0 && offset>=(off_t)MAX_FILE_SIZE){	//nothing fits in one index block
+		res = -EFBIG;
+	}else if(offset+size>MAX_FILE_SIZE){	//write what fits, like any file system at its limit
+		size = MAX_FILE_SIZE-offset;
+	}
+	if(res<0){
+		pthread_mutex_unlock(dir_lock);
 		free(root);
 		free(dirt);
-		return -ENOENT;
+		return res;
 	}
+	long file_size = dirt->files[j].fsize;
+	long end = offset+size;
+	long new_size = end>file_size ? end : file_size;
+	long index_block = dirt->files[j].nIndexBlock;
+	cs1550_index_block* index_blk = block_alloc(sizeof(cs1550_index_block));
+	disk_read(512*index_block,index_blk,sizeof(cs1550_index_block));
+	res = file_unshare(root,i,dirt,j,index_blk);	//clones and snapshots keep what they had
+	if(res<0){
+		pthread_mutex_unlock(dir_lock);
+		free(index_blk);
+		free(root);
+		free(dirt);
+		return res;
+	}
+	index_block = dirt->files[j].nIndexBlock;
 
-	for(i=0;i<root->nDirectories;i++){
-		if(strcmp(root->directories[i].dname,dir_name)==0){
-			fseek(fp,512*root->directories[i].nStartBlock,SEEK_SET);
-			fread(dirt,sizeof(cs1550_directory_entry),1,fp);
-			break;
+	//go through the clusters the write touches
+	char* cluster = block_alloc(CLUSTER_SIZE);
+	long pos = offset;
+	while(pos<end){
+		int c = pos/CLUSTER_SIZE;
+		long cluster_start = (long)c*CLUSTER_SIZE;
+		int from = pos-cluster_start;
+		int to = end<cluster_start+CLUSTER_SIZE ? end-cluster_start : CLUSTER_SIZE;
+		int old_len = file_size-cluster_start;
+		if(old_len<0){
+			old_len = 0;
+		}else if(old_len>CLUSTER_SIZE){
+			old_len = CLUSTER_SIZE;
+		}
+		int len = new_size<cluster_start+CLUSTER_SIZE ? new_size-cluster_start : CLUSTER_SIZE;
+		if(options.compress || ENTRY_CLEN(index_blk->entries[c*CLUSTER_BLOCKS])>0){
+			//compressed clusters are rewritten as a whole
+			res = cluster_load(index_block,index_blk,c,old_len,cluster);
+			if(res==0){
+				memcpy(cluster+from,buf+(pos-offset),to-from);
+				res = cluster_store(index_block,index_blk,c,cluster,len);
+			}
+			if(res<0){
+				break;
+			}
+			pos = cluster_start+to;
+		}else{
+			//uncompressed clusters up to the next compressed one are written together
+			long run_end = cluster_start+CLUSTER_SIZE;
+			while(run_end<end && ENTRY_CLEN(index_blk->entries[run_end/CLUSTER_SIZE*CLUSTER_BLOCKS])==0){
+				run_end += CLUSTER_SIZE;
+			}
+			if(run_end>end){
+				run_end = end;
+			}
+			res = blocks_write_raw(index_blk,pos,run_end,buf+(pos-offset),file_size,new_size);
+			if(res<0){
+				break;
+			}
+			pos = run_end;
 		}
 	}
-	if(i==root->nDirectories){	//path doesn't exist
-		free(root);
-		free(dirt);
-		return -ENOENT;
+	disk_write(512*index_block,index_blk,sizeof(cs1550_index_block));
+
+	//Also update the file size with whatever made it to disk
+	if(pos>file_size){
+		dirt->files[j].fsize = pos;
+		disk_write(512*root->directories[i].nStartBlock,dirt,sizeof(cs1550_directory_entry));
+	}
+	pthread_mutex_unlock(dir_lock);
+	free(cluster);
+	free(index_blk);
+	free(root);
+	free(dirt);
+	//set size (should be same as input) and return, or error
+	if(pos==offset){
+		return res;
+	}
+	return pos-offset;
+}
+/*
+ * truncate is called when a new file is created (with a 0 size) or when an
+ * existing file is made shorter or longer. Blocks past the new size are
+ * dropped in one batch and growing the file just leaves a hole.
+ */
+static int cs1550_truncate(const char *path, off_t size)
+{
+	if(read_only){	//a snapshot
+		return -EROFS;
 	}
+	if(size<0){
+		return -EINVAL;
+	}
+	if(size>(off_t)MAX_FILE_SIZE){
+		return -EFBIG;
+	}
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dirt = block_alloc(sizeof(cs1550_directory_entry));
+	int i;
 	int j;
-	int file_size =0;
-	for(j=0;j<dirt->nFiles;j++){//j will be the index for the file in dirt
-		if(strcmp(dirt->files[j].fname,filename)==0 && strcmp(dirt->files[j].fname,filename)==0){
-			if(offset>dirt->files[j].fsize){ //offset too big
-				free(root);
-				free(dirt);
-				return -EFBIG;		
-			}
-			file_size = dirt->files[j].fsize;
-			break;
-		} 
+	pthread_mutex_t* dir_lock = dir_lock_of(path);
+	pthread_mutex_lock(dir_lock);
+	int res = find_file(path,root,dirt,&i,&j);
+	if(res<0){
+		pthread_mutex_unlock(dir_lock);
+		free(root);
+		free(dirt);
+		return res;
 	}
-	if(j==dirt->nFiles){// path doesn't exist
+	long file_size = dirt->files[j].fsize;
+	long index_block = dirt->files[j].nIndexBlock;
+	cs1550_index_block* index_blk = block_alloc(sizeof(cs1550_index_block));
+	disk_read(512*index_block,index_blk,sizeof(cs1550_index_block));
+	res = file_unshare(root,i,dirt,j,index_blk);	//clones and snapshots keep what they had
+	if(res<0){
+		pthread_mutex_unlock(dir_lock);
+		free(index_blk);
 		free(root);
 		free(dirt);
-		return -ENOENT;
+		return res;
 	}
-	cs1550_index_block* index_blk = malloc(sizeof(cs1550_index_block));
-	fseek(fp,512*dirt->files[j].nIndexBlock,SEEK_SET);
-	fread(index_blk,sizeof(cs1550_index_block),1,fp);
-	
-	int count = file_size/512+1;	//how many blocks are used by the file
-	int block_need = 0;
-	int start_block = 0;	//where the write should start
-	int start_from = 0;		//which byte in the block to start from
-	//size_t new_file_size = 0;
-	if(offset<file_size){	//this is an overwrite
-		int free_space = offset+size - count*512;	//how much more space needed for writing
-		if(free_space>0){	//need more blocks
-			block_need = 1 + (offset+size-file_size)/512;
+	index_block = dirt->files[j].nIndexBlock;
+
+	int first_dropped = (size+BLOCK_SIZE-1)/BLOCK_SIZE;	//first entry past the new end
+	int c = size/CLUSTER_SIZE;
+	long cluster_start = (long)c*CLUSTER_SIZE;
+	int keep = size-cluster_start;	//bytes of cluster c that stay
+	if(size<file_size && keep>0){
+		//whatever is left of the old data past the new end has to read as zeros
+		//if the file grows again
+		int old_len = file_size-cluster_start<CLUSTER_SIZE ? file_size-cluster_start : CLUSTER_SIZE;
+		long* e = &index_blk->entries[c*CLUSTER_BLOCKS];
+		char* cluster = block_alloc(CLUSTER_SIZE);
+		memset(cluster,0,CLUSTER_SIZE);
+		if(ENTRY_CLEN(e[0])>0){
+			res = cluster_load(index_block,index_blk,c,old_len,cluster);
+			if(res==0){
+				memset(cluster+keep,0,CLUSTER_SIZE-keep);
+				res = cluster_store(index_block,index_blk,c,cluster,keep);
+			}
+			first_dropped = (c+1)*CLUSTER_BLOCKS;
+		}else if(size%BLOCK_SIZE!=0 && ENTRY_HAS_DATA(index_blk->entries[size/BLOCK_SIZE])){
+			int tail = BLOCK_SIZE-size%BLOCK_SIZE;
+			res = blocks_write_raw(index_blk,size,size+tail,cluster,file_size,size);
 		}
-		file_size = offset+size ; 				//file size is now offset+size
-		start_block = offset/512;
-		start_from = offset%512;
+		free(cluster);
 	}
-	else 	//this is a append
-	{	
-
-		if(file_size%512 == 0 && file_size!=0 ){		//this means that there is no more space left for the write	
-			block_need = size/512 + 1;
+	if(res==0){
+		struct block_batch batch;
+		memset(&batch,0,sizeof(batch));
+		int k;
+		for(k=first_dropped;k<(int)MAX_ENTRIES_IN_INDEX_BLOCK;k++){
+			batch_drop(&batch,ENTRY_BLOCK(index_blk->entries[k]));
+			index_blk->entries[k] = NO_BLOCK;
+		}
+		batch_finish(&batch);
+		for(k=first_dropped/CLUSTER_BLOCKS;k<(int)(MAX_ENTRIES_IN_INDEX_BLOCK/CLUSTER_BLOCKS);k++){
+			if(k*CLUSTER_BLOCKS>=first_dropped){
+				cache_drop(index_block,k);
+			}
 		}
-		//if the file ends in the middle of a block
-		else if(512-file_size%512 >= size){		//there is enough space to write, no more block needed
+		dirt->files[j].fsize = size;
+		disk_write(512*root->directories[i].nStartBlock,dirt,sizeof(cs1550_directory_entry));
+	}
+	disk_write(512*index_block,index_blk,sizeof(cs1550_index_block));
+	pthread_mutex_unlock(dir_lock);
+	free(index_blk);
+	free(root);
+	free(dirt);
+	return res;
+}
+
+#if FUSE_VERSION >= 29
+/*
+ * Reserves blocks for [offset, offset+length) up front, as one contiguous run
+ * if the disk has one. They are marked unwritten so they read as zeros
+ * without anything having to be written to them.
+ */
+static int cs1550_fallocate(const char *path, int mode, off_t offset, off_t length,
+			  struct fuse_file_info *fi)
+{
+	(void) fi;
+	if(read_only){	//a snapshot
+		return -EROFS;
+	}
+	if(mode & ~FALLOC_FL_KEEP_SIZE){
+		return -EOPNOTSUPP;
+	}
+	if(offset<0 || length<=0){
+		return -EINVAL;
+	}
+	if(offset+length>(off_t)MAX_FILE_SIZE){
+		return -EFBIG;
+	}
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dirt = block_alloc(sizeof(cs1550_directory_entry));
+	int i;
+	int j;
+	pthread_mutex_t* dir_lock = dir_lock_of(path);
+	pthread_mutex_lock(dir_lock);
+	int res = find_file(path,root,dirt,&i,&j);
+	if(res<0){
+		pthread_mutex_unlock(dir_lock);
+		free(root);
+		free(dirt);
+		return res;
+	}
+	long index_block = dirt->files[j].nIndexBlock;
+	cs1550_index_block* index_blk = block_alloc(sizeof(cs1550_index_block));
+	disk_read(512*index_block,index_blk,sizeof(cs1550_index_block));
+	res = file_unshare(root,i,dirt,j,index_blk);	//clones and snapshots keep what they had
+	if(res<0){
+		pthread_mutex_unlock(dir_lock);
+		free(index_blk);
+		free(root);
+		free(dirt);
+		return res;
+	}
+	index_block = dirt->files[j].nIndexBlock;
 
+	//holes in the range, compressed clusters already have what they need
+	int first = offset/BLOCK_SIZE;
+	int last = (offset+length-1)/BLOCK_SIZE;
+	int need = 0;
+	int k;
+	for(k=first;k<=last;k++){
+		long* e = &index_blk->entries[k];
+		if(ENTRY_BLOCK(*e)==NO_BLOCK && ENTRY_CLEN(index_blk->entries[k-k%CLUSTER_BLOCKS])==0){
+			need++;
 		}
-		else{	//remaining space in the block is not enough
-			block_need = 1 + (size-(512-file_size%512))/512;		//simple arithmitic
+	}
+	long blocks[MAX_ENTRIES_IN_INDEX_BLOCK];
+	if(need>0){
+		long start = bitmap_alloc_run(need);
+		if(start>=0){
+			for(k=0;k<need;k++){
+				blocks[k] = start+k;
+			}
+		}else{	//no run that long, take what there is
+			res = bitmap_alloc(blocks,need);
 		}
-		start_block = file_size/512;
-		start_from = file_size%512;
-		file_size += size;
-		
 	}
-	//now we need to find the blocks if needed
-	if(block_need >0){
-		int a;
-		for(a=0;a<block_need;a++){
-			index_blk->entries[count] = bitmap_find(fp);
-			count++;
-		}
-	}
-	fseek(fp,512*dirt->files[j].nIndexBlock,SEEK_SET);
-	fwrite(index_blk,sizeof(cs1550_index_block),1,fp);
-	//after everythinh start writing to disk
-	long data_to_write = size;
-	cs1550_disk_block* data_block = malloc(sizeof(cs1550_disk_block));
-	char* data_buf = malloc(size);
-	strcpy(data_buf,buf);
-
-	strncpy(data_block->data,data_buf,sizeof(data_block->data));
-	while(data_to_write>0){
-		fseek(fp,index_blk->entries[start_block]*512,SEEK_SET);
-		fseek(fp,start_from,SEEK_CUR);
-		if(data_to_write<=512){
-			fwrite(data_block,data_to_write,1,fp);
-		}else{
-			fwrite(data_block,512,1,fp);
-			free(data_block);
-			data_block = malloc(sizeof(cs1550_disk_block));
-			strncpy(data_block->data,data_buf+=512*sizeof(char),sizeof(data_block->data));
+	if(res==0){
+		need = 0;
+		for(k=first;k<=last;k++){
+			long* e = &index_blk->entries[k];
+			if(ENTRY_BLOCK(*e)==NO_BLOCK && ENTRY_CLEN(index_blk->entries[k-k%CLUSTER_BLOCKS])==0){
+				*e = blocks[need++] | ENTRY_UNWRITTEN;
+			}
+		}
+		disk_write(512*index_block,index_blk,sizeof(cs1550_index_block));
+		if(!(mode & FALLOC_FL_KEEP_SIZE) && offset+length>(off_t)dirt->files[j].fsize){
+			dirt->files[j].fsize = offset+length;
+			disk_write(512*root->directories[i].nStartBlock,dirt,sizeof(cs1550_directory_entry));
 		}
+	}
+	pthread_mutex_unlock(dir_lock);
+	free(index_blk);
+	free(root);
+	free(dirt);
+	return res;
+}
+#endif
 
-		data_to_write -=512;
-		start_block++;
+#if FUSE_VERSION >= 28
+/*
+ * ioctls on any file in the volume, with a cs1550_ioctl_arg: CS1550_IOC_CLONE
+ * clones the file to the path given, CS1550_IOC_SNAPSHOT and
+ * CS1550_IOC_SNAPSHOT_DELETE take or drop the snapshot named.
+ */
+static int cs1550_ioctl(const char *path, int cmd, void *arg,
+			  struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	(void) arg;
+	(void) fi;
+	if(flags & FUSE_IOCTL_COMPAT){
+		return -ENOSYS;
+	}
+	if(read_only){
+		return -EROFS;
+	}
+	struct cs1550_ioctl_arg* req = data;
+	req->path[sizeof(req->path)-1] = '\0';
+	switch((unsigned int)cmd){
+	case CS1550_IOC_CLONE:
+		return cs1550_clone(path,req->path);
+	case CS1550_IOC_SNAPSHOT:
+		return cs1550_snapshot(req->path);
+	case CS1550_IOC_SNAPSHOT_DELETE:
+		return cs1550_snapshot_delete(req->path);
 	}
-
-	//Also update the file size 
-	dirt->files[j].fsize =file_size;
-	fseek(fp,512*root->directories[i].nStartBlock,SEEK_SET);
-	fwrite(dirt,sizeof(cs1550_directory_entry),1,fp);
-	free(data_buf);
-	free(index_blk);
-	free(data_block);
-	free(root);
-	free(dirt);
-	fclose(fp);
-	//set size (should be same as input) and return, or error
-	return size;
+	return -ENOTTY;
 }
+#endif
+
 /*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
- *
+ * Reports capacity and usage for df. Everything comes from the counters the
+ * allocator keeps, so this never touches the disk.
  */
-static int cs1550_truncate(const char *path, off_t size)
+static int cs1550_statfs(const char *path, struct statvfs *stbuf)
 {
 	(void) path;
-	(void) size;
-
-    return 0;
+	memset(stbuf,0,sizeof(struct statvfs));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = TOTAL_BLOCKS;
+	stbuf->f_files = MAX_DIRS_IN_ROOT * (MAX_FILES_IN_DIR + 1);	//every directory and every file slot
+	stbuf->f_namemax = MAX_FILENAME + 1 + MAX_EXTENSION;
+	pthread_mutex_lock(&alloc_lock);
+	//blocks waiting in the reclaim queue are as good as free, an allocation
+	//that needs them drains it
+	stbuf->f_bfree = superblock.nFreeBlocks+reclaim_count;
+	stbuf->f_bavail = stbuf->f_bfree;
+	stbuf->f_ffree = stbuf->f_files - superblock.nDirectories - superblock.nFiles;
+	pthread_mutex_unlock(&alloc_lock);
+	stbuf->f_favail = stbuf->f_ffree;
+	return 0;
 }
 
-
 /*
  * Called when we open a file
  *
@@ -800,16 +3170,252 @@ static void * cs1550_init(struct fuse_conn_info* fi)
 
 	  (void) fi;
     printf("We're all gonna live from here ....\n");
+		disk_workers_start();	//threads have to be started after fuse forks
+		reclaim_start();
 		return NULL;
 }
 
 static void cs1550_destroy(void* args)
 {
 		(void) args;
+		reclaim_finish();
+		tables_flush();
+		//the counters are recounted at mount anyway, this keeps the copy on disk current
+		superblock_write();
+		disks_close();
     printf("... and die like a boss here\n");
 }
 
 
+/*
+ * Disks formatted before there was a superblock can have garbage in the index
+ * entries past the end of each file (they were never cleared), which would
+ * now be taken for allocated blocks. Clear those once and stamp the disk.
+ */
+static int superblock_check(void)
+{
+	disk_read(SUPERBLOCK_OFFSET,&superblock,sizeof(cs1550_superblock));
+	if(superblock.magic==CS1550_MAGIC){
+		if(superblock.nDisks==0){	//from before striping
+			superblock.nDisks = nDisks;
+			superblock.nStripeBlocks = nStripeBlocks;
+			superblock_write();
+		}
+		if(superblock.nDisks!=nDisks || superblock.nStripeBlocks!=nStripeBlocks){
+			fprintf(stderr,"the volume is laid out over %d backing files in units of %d blocks\n",
+					superblock.nDisks,superblock.nStripeBlocks);
+			return -1;
+		}
+		return 0;
+	}
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dir = block_alloc(sizeof(cs1550_directory_entry));
+	cs1550_index_block* index_blk = block_alloc(sizeof(cs1550_index_block));
+	disk_read(0,root,sizeof(cs1550_root_directory));
+	int i,j,k;
+	for(i=0;i<root->nDirectories;i++){
+		disk_read(512*root->directories[i].nStartBlock,dir,sizeof(cs1550_directory_entry));
+		for(j=0;j<dir->nFiles;j++){
+			int used = (dir->files[j].fsize+BLOCK_SIZE-1)/BLOCK_SIZE;
+			if(used==0){
+				used = 1;	//mknod used to give every file its first block
+			}
+			disk_read(512*dir->files[j].nIndexBlock,index_blk,sizeof(cs1550_index_block));
+			for(k=used;k<(int)MAX_ENTRIES_IN_INDEX_BLOCK;k++){
+				index_blk->entries[k] = NO_BLOCK;
+			}
+			disk_write(512*dir->files[j].nIndexBlock,index_blk,sizeof(cs1550_index_block));
+		}
+	}
+	memset(&superblock,0,sizeof(cs1550_superblock));
+	superblock.magic = CS1550_MAGIC;
+	superblock.version = CS1550_VERSION;
+	superblock.nDisks = nDisks;
+	superblock.nStripeBlocks = nStripeBlocks;
+	superblock_write();
+	free(index_blk);
+	free(dir);
+	free(root);
+	return 0;
+}
+
+//Data the live files held at mount is all on disk, so dedup may share any
+//of it. Everything else, the fingerprint index may point at too, it may not.
+static void dedup_rebuild(void)
+{
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dir = block_alloc(sizeof(cs1550_directory_entry));
+	cs1550_index_block* index_blk = block_alloc(sizeof(cs1550_index_block));
+	int i;
+	int j;
+	int k;
+	memset(dedup_shareable,0,sizeof(dedup_shareable));
+	disk_read(0,root,sizeof(cs1550_root_directory));
+	for(i=0;i<root->nDirectories;i++){
+		disk_read(512*root->directories[i].nStartBlock,dir,sizeof(cs1550_directory_entry));
+		for(j=0;j<dir->nFiles;j++){
+			disk_read(512*dir->files[j].nIndexBlock,index_blk,sizeof(cs1550_index_block));
+			for(k=0;k<(int)MAX_ENTRIES_IN_INDEX_BLOCK;k++){
+				long e = index_blk->entries[k];
+				if(ENTRY_HAS_DATA(e)){
+					dedup_shareable[ENTRY_BLOCK(e)/8] |= 1<<(ENTRY_BLOCK(e)%8);
+				}
+			}
+		}
+	}
+	free(index_blk);
+	free(dir);
+	free(root);
+}
+
+/*
+ * Reads in the reference count table, if the disk has one, and the dedup
+ * fingerprint index when mounted with dedup. Both are created on the first
+ * dedup mount, unless a clone or snapshot needed the reference counts first.
+ */
+static int tables_load(void)
+{
+	if(superblock.nRefBlock!=NO_BLOCK){
+		refcounts = block_alloc(REF_TABLE_BLOCKS*BLOCK_SIZE);
+		disk_read(superblock.nRefBlock*512,refcounts,REF_TABLE_BLOCKS*BLOCK_SIZE);
+	}else if(options.dedup && refs_ensure()<0){
+		return -ENOSPC;
+	}
+	if(options.dedup && superblock.nFingerprintBlock==NO_BLOCK){
+		long start = table_create(FINGERPRINT_TABLE_BLOCKS);
+		if(start<0){
+			return start;
+		}
+		superblock_set(&superblock.nFingerprintBlock,start);
+	}
+	if(options.dedup){
+		fingerprints = block_alloc(FINGERPRINT_TABLE_BLOCKS*BLOCK_SIZE);
+		disk_read(superblock.nFingerprintBlock*512,fingerprints,FINGERPRINT_TABLE_BLOCKS*BLOCK_SIZE);
+		dedup_rebuild();
+	}
+	return 0;
+}
+
+/*
+ * Blocks only go back to the bitmap through the reclaimer, so a crash while
+ * some were still queued leaves them marked used with nothing pointing at
+ * them. At mount everything reachable from the live root, the snapshots and
+ * the tables is marked, and whatever else the bitmap holds is given back.
+ */
+static void sweep_mark(unsigned char* reachable,long block){
+	if(block>=0 && block<TOTAL_BLOCKS){
+		reachable[block/8] |= 1<<(block%8);
+	}
+}
+
+static bool sweep_marked(const unsigned char* reachable,long block){
+	return (reachable[block/8]>>(block%8)) & 1;
+}
+
+//marks a root, be it the live one or a snapshot's, and everything under it
+static void sweep_tree(unsigned char* reachable,long root_at)
+{
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dir = block_alloc(sizeof(cs1550_directory_entry));
+	cs1550_index_block* index_blk = block_alloc(sizeof(cs1550_index_block));
+	sweep_mark(reachable,root_at);
+	disk_read(512*root_at,root,sizeof(cs1550_root_directory));
+	int i,j,k;
+	for(i=0;i<root->nDirectories;i++){
+		sweep_mark(reachable,root->directories[i].nStartBlock);
+		disk_read(512*root->directories[i].nStartBlock,dir,sizeof(cs1550_directory_entry));
+		for(j=0;j<dir->nFiles;j++){
+			sweep_mark(reachable,dir->files[j].nIndexBlock);
+			disk_read(512*dir->files[j].nIndexBlock,index_blk,sizeof(cs1550_index_block));
+			for(k=0;k<(int)MAX_ENTRIES_IN_INDEX_BLOCK;k++){
+				if(ENTRY_BLOCK(index_blk->entries[k])!=NO_BLOCK){	//unwritten ones are owned too
+					sweep_mark(reachable,ENTRY_BLOCK(index_blk->entries[k]));
+				}
+			}
+		}
+	}
+	free(index_blk);
+	free(dir);
+	free(root);
+}
+
+static void bitmap_sweep(void)
+{
+	unsigned char reachable[BITMAP_BYTES];
+	memset(reachable,0,sizeof(reachable));
+	int k;
+	for(k=TOTAL_BLOCKS-3;k<TOTAL_BLOCKS;k++){
+		sweep_mark(reachable,k);	//the bitmap and the superblock
+	}
+	for(k=0;superblock.nRefBlock!=NO_BLOCK && k<REF_TABLE_BLOCKS;k++){
+		sweep_mark(reachable,superblock.nRefBlock+k);
+	}
+	for(k=0;superblock.nFingerprintBlock!=NO_BLOCK && k<(int)FINGERPRINT_TABLE_BLOCKS;k++){
+		sweep_mark(reachable,superblock.nFingerprintBlock+k);
+	}
+	sweep_tree(reachable,0);
+	cs1550_root_directory* list = block_alloc(sizeof(cs1550_root_directory));
+	if(snapshots_read(list)){
+		sweep_mark(reachable,superblock.nSnapshotBlock);
+		for(k=0;k<list->nDirectories;k++){
+			sweep_tree(reachable,list->directories[k].nStartBlock);
+		}
+	}
+	free(list);
+
+	unsigned char bitmap[BITMAP_AREA] __attribute__((aligned(BUFFER_ALIGN)));
+	disk_read(BITMAP_OFFSET,bitmap,BITMAP_AREA);
+	long* orphans = malloc(TOTAL_BLOCKS*sizeof(long));
+	int n = 0;
+	for(k=0;k<TOTAL_BLOCKS;k++){
+		if(sweep_marked(reachable,k)){
+			continue;
+		}
+		if(!checkBit(bitmap[k/8],k%8)){
+			orphans[n++] = k;
+		}
+		if(ref_count(k)>0){	//a count nothing backs keeps the block from ever being allocated
+			refcounts[k] = 0;
+			ref_sync(k);
+		}
+	}
+	if(n>0){
+		printf("giving back %d blocks nothing points at\n",n);
+		bitmap_release(orphans,n);
+	}
+	tables_flush();
+	free(orphans);
+}
+
+/*
+ * Recounts the usage counters: free blocks with one popcount pass over the
+ * bitmap, directories and files from the root and directory blocks.
+ */
+static void usage_rebuild(void)
+{
+	unsigned long words[BITMAP_AREA / sizeof(unsigned long)] __attribute__((aligned(BUFFER_ALIGN)));
+	disk_read(BITMAP_OFFSET,words,BITMAP_AREA);
+	long used = 0;
+	int k;
+	for(k=0;k<(int)(BITMAP_BYTES / sizeof(unsigned long));k++){
+		used += __builtin_popcountl(words[k]);
+	}
+	cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
+	cs1550_directory_entry* dir = block_alloc(sizeof(cs1550_directory_entry));
+	disk_read(0,root,sizeof(cs1550_root_directory));
+	long files = 0;
+	for(k=0;k<root->nDirectories;k++){
+		disk_read(512*root->directories[k].nStartBlock,dir,sizeof(cs1550_directory_entry));
+		files += dir->nFiles;
+	}
+	superblock.nFreeBlocks = TOTAL_BLOCKS-used;
+	superblock.nDirectories = root->nDirectories;
+	superblock.nFiles = files;
+	superblock_write();
+	free(root);
+	free(dir);
+}
+
 //register our new functions as the implementations of the syscalls
 static struct fuse_operations hello_oper = {
     .getattr	= cs1550_getattr,
@@ -821,20 +3427,532 @@ static struct fuse_operations hello_oper = {
 		.mknod	= cs1550_mknod,
 		.unlink = cs1550_unlink,
 		.truncate = cs1550_truncate,
+		.statfs = cs1550_statfs,
+#if FUSE_VERSION >= 29
+		.fallocate = cs1550_fallocate,
+#endif
+#if FUSE_VERSION >= 28
+		.ioctl = cs1550_ioctl,
+#endif
 		.flush = cs1550_flush,
 		.open	= cs1550_open,
 		.init = cs1550_init,
     .destroy = cs1550_destroy,
 };
 
-//Don't change this.
+/*
+ * Operation tracing. With -o trace=FILE every callback is timed and appended
+ * to FILE as a cs1550_trace_record followed by its path, so a workload can be
+ * captured once and replayed against any image later (see replay_run).
+ */
+#define	TRACE_MAGIC 0x43525431	//"1TRC"
+
+enum cs1550_trace_op
+{
+	TRACE_GETATTR,
+	TRACE_READDIR,
+	TRACE_MKDIR,
+	TRACE_RMDIR,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_MKNOD,
+	TRACE_UNLINK,
+	TRACE_TRUNCATE,
+	TRACE_STATFS,
+	TRACE_FALLOCATE,
+	TRACE_OPEN,
+	TRACE_FLUSH,
+	TRACE_IOCTL,
+	TRACE_OPS
+};
+
+static const char* trace_op_names[TRACE_OPS] = {
+	"getattr", "readdir", "mkdir", "rmdir", "read", "write", "mknod",
+	"unlink", "truncate", "statfs", "fallocate", "open", "flush", "ioctl"
+};
+
+struct cs1550_trace_record
+{
+	unsigned char op;
+	unsigned char padding;
+	unsigned short nPathLength;	//the path follows the record, without a nul. For
+						//an ioctl so does its argument's, after a nul.
+	int res;		//what the callback returned
+	int mode;		//for mkdir, mknod and fallocate, the command for an ioctl
+	long offset;
+	long size;		//bytes for read and write, the new size for truncate
+	long start;		//ns since tracing started
+	long latency;	//ns
+} __attribute__((packed));
+
+static FILE* trace_file;
+static long trace_epoch;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fuse_operations untraced;	//the real callbacks while tracing
+
+static long trace_now(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return now.tv_sec*1000000000L+now.tv_nsec;
+}
+
+static void trace_record_arg(int op,const char* path,const char* arg,long offset,long size,int mode,
+			long start,int res){
+	struct cs1550_trace_record rec;
+	memset(&rec,0,sizeof(rec));
+	rec.op = op;
+	rec.nPathLength = strlen(path)+(arg!=NULL ? 1+strlen(arg) : 0);
+	rec.res = res;
+	rec.mode = mode;
+	rec.offset = offset;
+	rec.size = size;
+	rec.start = start-trace_epoch;
+	rec.latency = trace_now()-start;
+	pthread_mutex_lock(&trace_lock);
+	fwrite(&rec,sizeof(rec),1,trace_file);
+	fwrite(path,strlen(path),1,trace_file);
+	if(arg!=NULL){
+		fputc('\0',trace_file);
+		fwrite(arg,strlen(arg),1,trace_file);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_record(int op,const char* path,long offset,long size,int mode,long start,int res){
+	trace_record_arg(op,path,NULL,offset,size,mode,start,res);
+}
+
+static int trace_getattr(const char *path, struct stat *stbuf)
+{
+	long start = trace_now();
+	int res = untraced.getattr(path,stbuf);
+	trace_record(TRACE_GETATTR,path,0,0,0,start,res);
+	return res;
+}
+
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	long start = trace_now();
+	int res = untraced.readdir(path,buf,filler,offset,fi);
+	trace_record(TRACE_READDIR,path,offset,0,0,start,res);
+	return res;
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+	long start = trace_now();
+	int res = untraced.mkdir(path,mode);
+	trace_record(TRACE_MKDIR,path,0,0,mode,start,res);
+	return res;
+}
+
+static int trace_rmdir(const char *path)
+{
+	long start = trace_now();
+	int res = untraced.rmdir(path);
+	trace_record(TRACE_RMDIR,path,0,0,0,start,res);
+	return res;
+}
+
+static int trace_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	long start = trace_now();
+	int res = untraced.read(path,buf,size,offset,fi);
+	trace_record(TRACE_READ,path,offset,size,0,start,res);
+	return res;
+}
+
+static int trace_write(const char *path, const char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	long start = trace_now();
+	int res = untraced.write(path,buf,size,offset,fi);
+	trace_record(TRACE_WRITE,path,offset,size,0,start,res);
+	return res;
+}
+
+static int trace_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	long start = trace_now();
+	int res = untraced.mknod(path,mode,dev);
+	trace_record(TRACE_MKNOD,path,0,0,mode,start,res);
+	return res;
+}
+
+static int trace_unlink(const char *path)
+{
+	long start = trace_now();
+	int res = untraced.unlink(path);
+	trace_record(TRACE_UNLINK,path,0,0,0,start,res);
+	return res;
+}
+
+static int trace_truncate(const char *path, off_t size)
+{
+	long start = trace_now();
+	int res = untraced.truncate(path,size);
+	trace_record(TRACE_TRUNCATE,path,0,size,0,start,res);
+	return res;
+}
+
+static int trace_statfs(const char *path, struct statvfs *stbuf)
+{
+	long start = trace_now();
+	int res = untraced.statfs(path,stbuf);
+	trace_record(TRACE_STATFS,path,0,0,0,start,res);
+	return res;
+}
+
+#if FUSE_VERSION >= 29
+static int trace_fallocate(const char *path, int mode, off_t offset, off_t length,
+			  struct fuse_file_info *fi)
+{
+	long start = trace_now();
+	int res = untraced.fallocate(path,mode,offset,length,fi);
+	trace_record(TRACE_FALLOCATE,path,offset,length,mode,start,res);
+	return res;
+}
+#endif
+
+static int trace_open(const char *path, struct fuse_file_info *fi)
+{
+	long start = trace_now();
+	int res = untraced.open(path,fi);
+	trace_record(TRACE_OPEN,path,0,0,0,start,res);
+	return res;
+}
+
+static int trace_flush(const char *path, struct fuse_file_info *fi)
+{
+	long start = trace_now();
+	int res = untraced.flush(path,fi);
+	trace_record(TRACE_FLUSH,path,0,0,0,start,res);
+	return res;
+}
+
+#if FUSE_VERSION >= 28
+static int trace_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+			unsigned int flags, void *data)
+{
+	//copied first, data is where an ioctl would hand results back
+	struct cs1550_ioctl_arg req;
+	memset(&req,0,sizeof(req));
+	if(data!=NULL && !(flags & FUSE_IOCTL_COMPAT)){
+		memcpy(req.path,((struct cs1550_ioctl_arg*)data)->path,sizeof(req.path)-1);
+	}
+	long start = trace_now();
+	int res = untraced.ioctl(path,cmd,arg,fi,flags,data);
+	trace_record_arg(TRACE_IOCTL,path,req.path,0,0,cmd,start,res);
+	return res;
+}
+#endif
+
+static void trace_destroy(void* args)
+{
+	untraced.destroy(args);
+	pthread_mutex_lock(&trace_lock);
+	fclose(trace_file);
+	trace_file = NULL;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+//opens the trace file and puts the tracing callbacks in front of the real ones
+static int trace_start(struct fuse_operations* ops)
+{
+	trace_file = fopen(options.trace,"wb");
+	if(trace_file==NULL){
+		perror(options.trace);
+		return -1;
+	}
+	int magic = TRACE_MAGIC;
+	fwrite(&magic,sizeof(magic),1,trace_file);
+	trace_epoch = trace_now();
+	untraced = *ops;
+	ops->getattr = trace_getattr;
+	ops->readdir = trace_readdir;
+	ops->mkdir = trace_mkdir;
+	ops->rmdir = trace_rmdir;
+	ops->read = trace_read;
+	ops->write = trace_write;
+	ops->mknod = trace_mknod;
+	ops->unlink = trace_unlink;
+	ops->truncate = trace_truncate;
+	ops->statfs = trace_statfs;
+#if FUSE_VERSION >= 29
+	ops->fallocate = trace_fallocate;
+#endif
+	ops->open = trace_open;
+	ops->flush = trace_flush;
+#if FUSE_VERSION >= 28
+	ops->ioctl = trace_ioctl;
+#endif
+	ops->destroy = trace_destroy;
+	return 0;
+}
+
+/*
+ * Replay. With -o replay=FILE the trace is run through the callbacks against
+ * whatever image is given (copy it first to keep the original), instead of
+ * mounting. Records keep their recorded spacing unless replay_fast is set.
+ * With replay_threads=N each top level directory is handed to one of N
+ * threads, so operations on the same directory still happen in recorded
+ * order. Written data is generated from the record number, so every replay
+ * of a trace writes the same bytes.
+ */
+struct replay_state
+{
+	struct cs1550_trace_record* recs;
+	char** paths;
+	long* latency;	//measured for each record
+	int* res;
+	int nRecs;
+	int nThreads;
+	long epoch;
+};
+
+struct replay_worker
+{
+	struct replay_state* state;
+	int nThread;
+	pthread_t thread;
+};
+
+static int replay_filler(void* buf,const char* name,const struct stat* stbuf,off_t off){
+	(void) buf;
+	(void) name;
+	(void) stbuf;
+	(void) off;
+	return 0;
+}
+
+//which thread a path belongs to, by its top level directory
+static int replay_thread_of(const char* path,int nThreads){
+	unsigned long hash = 5381;
+	const char* p;
+	for(p=path+1;*p!='\0' && *p!='/';p++){
+		hash = hash*33+(unsigned char)*p;
+	}
+	return hash%nThreads;
+}
+
+static int replay_one(const struct cs1550_trace_record* rec,const char* path,char* buf,int nRec){
+	struct fuse_file_info fi;
+	memset(&fi,0,sizeof(fi));
+	switch(rec->op){
+	case TRACE_GETATTR:{
+		struct stat st;
+		return hello_oper.getattr(path,&st);
+	}
+	case TRACE_READDIR:
+		return hello_oper.readdir(path,NULL,replay_filler,rec->offset,&fi);
+	case TRACE_MKDIR:
+		return hello_oper.mkdir(path,rec->mode);
+	case TRACE_RMDIR:
+		return hello_oper.rmdir(path);
+	case TRACE_READ:
+		return hello_oper.read(path,buf,rec->size,rec->offset,&fi);
+	case TRACE_WRITE:{
+		unsigned int seed = nRec;
+		long k;
+		for(k=0;k<rec->size;k++){
+			buf[k] = rand_r(&seed)>>7;
+		}
+		return hello_oper.write(path,buf,rec->size,rec->offset,&fi);
+	}
+	case TRACE_MKNOD:
+		return hello_oper.mknod(path,rec->mode,0);
+	case TRACE_UNLINK:
+		return hello_oper.unlink(path);
+	case TRACE_TRUNCATE:
+		return hello_oper.truncate(path,rec->size);
+	case TRACE_STATFS:{
+		struct statvfs st;
+		return hello_oper.statfs(path,&st);
+	}
+#if FUSE_VERSION >= 29
+	case TRACE_FALLOCATE:
+		return hello_oper.fallocate(path,rec->mode,rec->offset,rec->size,&fi);
+#endif
+	case TRACE_OPEN:
+		return hello_oper.open(path,&fi);
+	case TRACE_FLUSH:
+		return hello_oper.flush(path,&fi);
+#if FUSE_VERSION >= 28
+	case TRACE_IOCTL:{
+		//the argument's path was recorded after the file's, past a nul
+		struct cs1550_ioctl_arg req;
+		memset(&req,0,sizeof(req));
+		size_t length = strlen(path);
+		if(length<rec->nPathLength){
+			strncpy(req.path,path+length+1,sizeof(req.path)-1);
+		}
+		return hello_oper.ioctl(path,rec->mode,NULL,&fi,0,&req);
+	}
+#endif
+	}
+	return -ENOSYS;
+}
+
+static void* replay_main(void* arg){
+	struct replay_worker* worker = arg;
+	struct replay_state* state = worker->state;
+	long max_size = 0;
+	int k;
+	for(k=0;k<state->nRecs;k++){
+		if(state->recs[k].size>max_size){
+			max_size = state->recs[k].size;
+		}
+	}
+	char* buf = malloc(max_size+1);
+	for(k=0;k<state->nRecs;k++){
+		const struct cs1550_trace_record* rec = &state->recs[k];
+		if(replay_thread_of(state->paths[k],state->nThreads)!=worker->nThread){
+			continue;
+		}
+		if(!options.replay_fast){
+			long when = state->epoch+rec->start;
+			struct timespec until = {when/1000000000L,when%1000000000L};
+			while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&until,NULL)==EINTR);
+		}
+		long start = trace_now();
+		state->res[k] = replay_one(rec,state->paths[k],buf,k);
+		state->latency[k] = trace_now()-start;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int compare_longs(const void* a,const void* b){
+	long x = *(const long*)a;
+	long y = *(const long*)b;
+	return x<y ? -1 : x>y;
+}
+
+//latency percentiles for one operation, in microseconds
+static void replay_report(const char* name,long* lat,int n,long* recorded){
+	if(n==0){
+		return;
+	}
+	qsort(lat,n,sizeof(long),compare_longs);
+	qsort(recorded,n,sizeof(long),compare_longs);
+	double sum = 0;
+	int k;
+	for(k=0;k<n;k++){
+		sum += lat[k];
+	}
+	printf("%-10s %8d %10.1f %10.1f %10.1f %10.1f %10.1f %12.1f\n",name,n,sum/n/1000,
+			lat[n/2]/1000.0,lat[n*9/10]/1000.0,lat[n*99/100]/1000.0,lat[n-1]/1000.0,recorded[n/2]/1000.0);
+}
+
+static int replay_run(void)
+{
+	FILE* in = fopen(options.replay,"rb");
+	if(in==NULL){
+		perror(options.replay);
+		return 1;
+	}
+	int magic = 0;
+	if(fread(&magic,sizeof(magic),1,in)!=1 || magic!=TRACE_MAGIC){
+		fprintf(stderr,"%s is not a trace\n",options.replay);
+		fclose(in);
+		return 1;
+	}
+	struct replay_state state;
+	memset(&state,0,sizeof(state));
+	int capacity = 0;
+	struct cs1550_trace_record rec;
+	while(fread(&rec,sizeof(rec),1,in)==1){
+		if(state.nRecs==capacity){
+			capacity = capacity==0 ? 1024 : 2*capacity;
+			state.recs = realloc(state.recs,capacity*sizeof(rec));
+			state.paths = realloc(state.paths,capacity*sizeof(char*));
+		}
+		char* path = malloc(rec.nPathLength+1);
+		if(fread(path,1,rec.nPathLength,in)!=rec.nPathLength){
+			free(path);
+			break;	//cut short, the daemon died while tracing
+		}
+		path[rec.nPathLength] = '\0';
+		state.recs[state.nRecs] = rec;
+		state.paths[state.nRecs++] = path;
+	}
+	fclose(in);
+	state.latency = calloc(state.nRecs+1,sizeof(long));
+	state.res = calloc(state.nRecs+1,sizeof(int));
+	state.nThreads = options.replay_threads>0 ? options.replay_threads : 1;
+
+	hello_oper.init(NULL);
+	struct replay_worker* workers = malloc(state.nThreads*sizeof(struct replay_worker));
+	long began = trace_now();
+	state.epoch = began;
+	int k;
+	for(k=0;k<state.nThreads;k++){
+		workers[k].state = &state;
+		workers[k].nThread = k;
+		pthread_create(&workers[k].thread,NULL,replay_main,&workers[k]);
+	}
+	for(k=0;k<state.nThreads;k++){
+		pthread_join(workers[k].thread,NULL);
+	}
+	long took = trace_now()-began;
+	hello_oper.destroy(NULL);
+
+	int differed = 0;
+	for(k=0;k<state.nRecs;k++){
+		if(state.res[k]!=state.recs[k].res){
+			differed++;
+		}
+	}
+	printf("replayed %d operations in %.3f s with %d thread(s), %d returned something else than when traced\n",
+			state.nRecs,took/1e9,state.nThreads,differed);
+	printf("%-10s %8s %10s %10s %10s %10s %10s %12s\n","op","count","mean us","p50","p90","p99","max","traced p50");
+	long* lat = malloc((state.nRecs+1)*sizeof(long));
+	long* recorded = malloc((state.nRecs+1)*sizeof(long));
+	int op;
+	for(op=0;op<TRACE_OPS;op++){
+		int n = 0;
+		for(k=0;k<state.nRecs;k++){
+			if(state.recs[k].op==op){
+				lat[n] = state.latency[k];
+				recorded[n++] = state.recs[k].latency;
+			}
+		}
+		replay_report(trace_op_names[op],lat,n,recorded);
+	}
+	for(k=0;k<state.nRecs;k++){
+		free(state.paths[k]);
+	}
+	free(lat);
+	free(recorded);
+	free(workers);
+	free(state.recs);
+	free(state.paths);
+	free(state.latency);
+	free(state.res);
+	return 0;
+}
+
+/*
+ * Opens the backing files (disks=, stripe=, direct), formats an empty volume
+ * and checks or upgrades the superblock, loads the tables and gives back
+ * whatever a crash left orphaned. Then either replays a trace (replay=) or
+ * hands over to fuse, tracing (trace=) or looking at a snapshot (snapshot=)
+ * if asked to.
+ */
 int main(int argc, char *argv[])
 {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1){
+		return 1;
+	}
+	if(disks_open()<0){
+		return 1;
+	}
 	//check look at the bit map to see if the root exits
-	FILE *fp = fopen(".disk","rb+");
-	unsigned char bmap[1280];
-	fseek(fp,-3*512,SEEK_END);
-	fread(bmap,1280,1,fp);
+	unsigned char bmap[BITMAP_AREA] __attribute__((aligned(BUFFER_ALIGN)));
+	disk_read(BITMAP_OFFSET,bmap,BITMAP_AREA);
 	//if the disk is empty create the root write to disk and initialize the bitmap
 	//printf("check bit %d\n",checkBit(3,1));//0
 	//printf("check set bit%d\n",setBit(3,2) );//7
@@ -842,11 +3960,10 @@ int main(int argc, char *argv[])
 	// checking the first bit of the first entry
 	if(checkBit(bmap[0],0)){
 		//write a new root directory to disk
-		cs1550_root_directory* root = malloc(sizeof(cs1550_root_directory));
+		cs1550_root_directory* root = block_alloc(sizeof(cs1550_root_directory));
 		root->nDirectories = 0;
 		//root->directories=NULL;
-		fseek(fp,0,SEEK_SET);
-		fwrite(root,sizeof(cs1550_root_directory),1,fp);
+		disk_write(0,root,sizeof(cs1550_root_directory));
 		//a new bitmap and initialized values
 		//1280 blocks
 		bmap[0]=setBit(0,0); //same as bmap[0]=1
@@ -856,10 +3973,36 @@ int main(int argc, char *argv[])
 		bmap[1279] =setBit(bmap[1279],7);*/
 		// really the same as: last 3 bits of last entry
 		bmap[1279] = 224;
-		fseek(fp,-3*512,SEEK_END);
-		fwrite(bmap,1280,1,fp);
+		disk_write(BITMAP_OFFSET,bmap,BITMAP_AREA);
 		free(root);
 	}
-	fclose(fp);
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	if(superblock_check()<0){
+		disks_close();
+		return 1;
+	}
+	if(tables_load()<0){
+		fprintf(stderr,"not enough free space for the dedup tables\n");
+		disks_close();
+		return 1;
+	}
+	if(options.snapshot==NULL){
+		bitmap_sweep();	//a snapshot is mounted read only
+	}
+	usage_rebuild();
+	if(options.snapshot!=NULL && snapshot_open(options.snapshot)<0){
+		fprintf(stderr,"there is no snapshot called %s\n",options.snapshot);
+		disks_close();
+		return 1;
+	}
+	if(options.trace!=NULL && trace_start(&hello_oper)<0){
+		disks_close();
+		return 1;
+	}
+	if(options.replay!=NULL){
+		fuse_opt_free_args(&args);
+		return replay_run();
+	}
+	int ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	fuse_opt_free_args(&args);
+	return ret;
 }